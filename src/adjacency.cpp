@@ -0,0 +1,93 @@
+#include "adjacency.hpp"
+
+namespace seqwish {
+
+void graph_adjacency_t::build(mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset, uint64_t node_count) {
+    n_nodes = node_count;
+    n_links = 0;
+    uint64_t n_handles = 2 * (n_nodes + 1);
+    // the set yields the links as derived in sorted order, so they already lie in their rows,
+    // but each reversed link belongs under the reverse of its target, so we count the rows to scatter them
+    std::vector<uint64_t> fwd_offsets(n_handles + 1, 0);
+    std::vector<uint64_t> rev_offsets(n_handles + 1, 0);
+    link_mmset.for_each_unique_value([&](const std::pair<pos_t, pos_t>& p) {
+            if (!p.first || !p.second) return;
+            ++fwd_offsets[p.first + 1];
+            ++rev_offsets[flip(p.second) + 1];
+            ++n_links;
+        });
+    for (uint64_t h = 1; h <= n_handles; ++h) {
+        fwd_offsets[h] += fwd_offsets[h-1];
+        rev_offsets[h] += rev_offsets[h-1];
+    }
+    std::vector<pos_t> fwd_edges(n_links);
+    std::vector<pos_t> rev_edges(n_links);
+    uint64_t n_fwd = 0;
+    link_mmset.for_each_unique_value([&](const std::pair<pos_t, pos_t>& p) {
+            if (!p.first || !p.second) return;
+            fwd_edges[n_fwd++] = p.second;
+            // we use each row's offset as its cursor, leaving it at the start of the next row
+            rev_edges[rev_offsets[flip(p.second)]++] = flip(p.first);
+        });
+    for (uint64_t h = n_handles; h > 0; --h) {
+        rev_offsets[h] = rev_offsets[h-1];
+    }
+    rev_offsets[0] = 0;
+    // a reversed row comes in the order of the links' sources, which flipping can swap within a node
+#pragma omp parallel for schedule(dynamic, 4096)
+    for (uint64_t h = 0; h < n_handles; ++h) {
+        std::sort(rev_edges.begin() + rev_offsets[h], rev_edges.begin() + rev_offsets[h+1]);
+    }
+    // a link can be derived along with its reverse, or be its own reverse, so we merge the two rows of each handle,
+    // calling emit with each distinct successor and whether it was derived
+    auto merge_rows = [&](uint64_t h, auto emit) {
+        uint64_t i = fwd_offsets[h], i_end = fwd_offsets[h+1];
+        uint64_t j = rev_offsets[h], j_end = rev_offsets[h+1];
+        while (i < i_end || j < j_end) {
+            if (j == j_end || (i < i_end && fwd_edges[i] <= rev_edges[j])) {
+                if (j < j_end && fwd_edges[i] == rev_edges[j]) ++j;
+                emit(fwd_edges[i++], true);
+            } else {
+                emit(rev_edges[j++], false);
+            }
+        }
+    };
+    offsets = sdsl::int_vector<>(n_handles + 1, 0);
+#pragma omp parallel for schedule(dynamic, 4096)
+    for (uint64_t h = 0; h < n_handles; ++h) {
+        uint64_t n = 0;
+        merge_rows(h, [&](pos_t, bool) { ++n; });
+        offsets[h+1] = n;
+    }
+    for (uint64_t h = 1; h <= n_handles; ++h) {
+        offsets[h] = offsets[h] + offsets[h-1];
+    }
+    uint64_t n_edges = offsets[n_handles];
+    // neighbouring rows can share a word of the bit vector, so we carry each edge's bit in its low bit
+    // and move them across afterwards a word at a time
+    edges = sdsl::int_vector<>(n_edges, 0);
+#pragma omp parallel for schedule(dynamic, 4096)
+    for (uint64_t h = 0; h < n_handles; ++h) {
+        uint64_t k = offsets[h];
+        merge_rows(h, [&](pos_t e, bool d) { edges[k++] = e << 1 | d; });
+    }
+    fwd_edges.clear();
+    fwd_edges.shrink_to_fit();
+    rev_edges.clear();
+    rev_edges.shrink_to_fit();
+    derived = sdsl::bit_vector(n_edges, 0);
+#pragma omp parallel for
+    for (uint64_t w = 0; w < n_edges; w += 64) {
+        uint64_t len = std::min((uint64_t)64, n_edges - w);
+        uint64_t bits = 0;
+        for (uint64_t i = 0; i < len; ++i) {
+            bits |= (uint64_t)(edges[w+i] & 1) << i;
+            edges[w+i] = edges[w+i] >> 1;
+        }
+        derived.set_int(w, bits, len);
+    }
+    sdsl::util::bit_compress(offsets);
+    sdsl::util::bit_compress(edges);
+}
+
+}
@@ -0,0 +1,75 @@
+#ifndef ADJACENCY_HPP_INCLUDED
+#define ADJACENCY_HPP_INCLUDED
+
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <cstdint>
+#include "sdsl/bit_vectors.hpp"
+#include "mmmultiset.hpp"
+#include "pos.hpp"
+
+namespace seqwish {
+
+// the links of the induced graph as compressed sparse rows over oriented node handles, make_pos_t(id, rev)
+// a link from a to b also lets us step from the reverse of b to the reverse of a, so each link is listed
+// under both, and a bit per listed edge remembers which ones were derived as they are
+// offsets and edges are bit-compressed to the width their largest values need
+class graph_adjacency_t {
+
+private:
+
+    uint64_t n_nodes = 0;
+    uint64_t n_links = 0;
+    // where the successors of each handle begin in edges, for handles 0 through 2*(n_nodes+1)
+    sdsl::int_vector<> offsets;
+    // successor handles, sorted for each handle
+    sdsl::int_vector<> edges;
+    // whether each edge is a link as derived, rather than the reverse of one
+    sdsl::bit_vector derived;
+    static pos_t flip(const pos_t& h) { return make_pos_t(offset(h), !is_rev(h)); }
+
+public:
+
+    // read the distinct links out of the indexed set
+    void build(mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset, uint64_t node_count);
+    uint64_t node_count(void) const { return n_nodes; }
+    // the number of links as derived
+    uint64_t link_count(void) const { return n_links; }
+    // call f on each handle we can step to from h, in sorted order
+    template <typename F>
+    void for_each_successor(const pos_t& h, const F& f) const {
+        for (uint64_t i = offsets[h]; i < offsets[h+1]; ++i) {
+            f((pos_t)edges[i]);
+        }
+    }
+    // call f on each handle that steps to h, given as the reverse of a successor of h's reverse
+    template <typename F>
+    void for_each_predecessor(const pos_t& h, const F& f) const {
+        pos_t r = flip(h);
+        for (uint64_t i = offsets[r]; i < offsets[r+1]; ++i) {
+            f(flip(edges[i]));
+        }
+    }
+    // handles run from 0 to handle_count(), including the unused ones of node 0
+    uint64_t handle_count(void) const { return offsets.size() ? offsets.size() - 1 : 0; }
+    // call f on each link as derived from the handles in [begin, end), in sorted order
+    template <typename F>
+    void for_each_link_in(pos_t begin, pos_t end, const F& f) const {
+        for (pos_t h = begin; h < end; ++h) {
+            for (uint64_t i = offsets[h]; i < offsets[h+1]; ++i) {
+                if (derived[i]) f(h, (pos_t)edges[i]);
+            }
+        }
+    }
+    // call f on each link as derived, in sorted order
+    template <typename F>
+    void for_each_link(const F& f) const {
+        for_each_link_in(0, handle_count(), f);
+    }
+
+};
+
+}
+
+#endif
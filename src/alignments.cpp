@@ -2,110 +2,398 @@
 
 namespace seqwish {
 
+void unpack_matches(size_t query_idx,
+                    uint64_t query_start,
+                    uint64_t query_end,
+                    bool q_rev,
+                    size_t target_idx,
+                    uint64_t target_start,
+                    const cigar_t& cigar,
+                    const seqindex_t& seqidx,
+                    match_set_t& match_set,
+                    iitree_writer_t<uint64_t, pos_t>& aln_writer,
+                    uint64_t min_match_len) {
+    size_t q_all_pos = (q_rev ? seqidx.pos_in_all_seqs(query_idx, query_end, false) - 1
+                        : seqidx.pos_in_all_seqs(query_idx, query_start, false));
+    size_t t_all_pos = seqidx.pos_in_all_seqs(target_idx, target_start, false);
+    pos_t q_pos = make_pos_t(q_all_pos, q_rev);
+    pos_t t_pos = make_pos_t(t_all_pos, false);
+    for (auto& c : cigar) {
+        switch (c.op) {
+        case 'M':
+        {
+            pos_t q_pos_match_start = q_pos;
+            pos_t t_pos_match_start = t_pos;
+            uint64_t match_len = 0;
+            auto add_match =
+                [&](void) {
+                    if (match_len && match_len >= min_match_len) {
+                        if (is_rev(q_pos)) {
+                            pos_t x_pos = q_pos;
+                            decr_pos(x_pos); // to guard against underflow when our start is 0-, we need to decr in pos_t space
+                            // skip matches we've already stored via the reciprocal alignment
+                            if (!match_set.insert(offset(x_pos), offset(t_pos_match_start), match_len, true)) return;
+                            aln_writer.add(offset(x_pos), offset(q_pos_match_start)+1, make_pos_t(offset(t_pos)-1, true));
+                            aln_writer.add(offset(t_pos_match_start), offset(t_pos), make_pos_t(offset(q_pos_match_start), true));
+                        } else {
+                            if (!match_set.insert(offset(q_pos_match_start), offset(t_pos_match_start), match_len, false)) return;
+                            aln_writer.add(offset(q_pos_match_start), offset(q_pos), t_pos_match_start);
+                            aln_writer.add(offset(t_pos_match_start), offset(t_pos), q_pos_match_start);
+                        }
+                    }
+                };
+            // decode both sides of the run at once, rather than looking up each base,
+            // which is slow in blocks holding lowercase or ambiguous bases
+            std::string q_seq = is_rev(q_pos)
+                ? seqidx.rev_comp_subseq(offset(q_pos) + 1 - c.len, c.len)
+                : seqidx.subseq(offset(q_pos), c.len);
+            std::string t_seq = seqidx.subseq(offset(t_pos), c.len);
+            for (size_t i = 0; i < c.len; ++i) {
+                if (q_seq[i] == t_seq[i]
+                    && offset(q_pos) != offset(t_pos)) { // guard against self mappings
+                    if (match_len == 0) {
+                        q_pos_match_start = q_pos;
+                        t_pos_match_start = t_pos;
+                    }
+                    ++match_len;
+                    incr_pos(q_pos);
+                    incr_pos(t_pos);
+                } else {
+                    add_match();
+                    incr_pos(q_pos);
+                    incr_pos(t_pos);
+                    match_len = 0;
+                    // break out the last match
+                }
+            }
+            // handle any last match
+            add_match();
+        }
+            break;
+        case 'I':
+            //std::cerr << "ins " << c.len << std::endl;
+            incr_pos(q_pos, c.len);
+            break;
+        case 'D':
+            //std::cerr << "del " << c.len << std::endl;
+            incr_pos(t_pos, c.len);
+            break;
+        default: break;
+        }
+    }
+}
+
+// collapsed duplicates are not closed, so we move their side of an alignment onto the sequence they copy,
+// turning the alignment around where the copy is a reverse complement
+// alignments between copies of the same sequence are implied by the collapse, and we return false for them
+static bool onto_representatives(const seqindex_t& seqidx,
+                                 size_t& query_idx,
+                                 uint64_t& query_start,
+                                 uint64_t& query_end,
+                                 bool& q_rev,
+                                 size_t& target_idx,
+                                 uint64_t& target_start,
+                                 uint64_t target_end,
+                                 cigar_t& cigar) {
+    pos_t q_dup = seqidx.duplicate_of(query_idx);
+    pos_t t_dup = seqidx.duplicate_of(target_idx);
+    if (!q_dup && !t_dup) return true;
+    size_t q_rep = q_dup ? offset(q_dup) : query_idx;
+    size_t t_rep = t_dup ? offset(t_dup) : target_idx;
+    if (q_rep == t_rep) return false;
+    if (q_dup) {
+        query_idx = q_rep;
+        if (is_rev(q_dup)) {
+            // the query range sits at the mirrored place on the other strand of the representative
+            uint64_t len = seqidx.nth_seq_length(query_idx);
+            uint64_t start = len - query_end;
+            query_end = len - query_start;
+            query_start = start;
+            q_rev = !q_rev;
+        }
+    }
+    if (t_dup) {
+        target_idx = t_rep;
+        if (is_rev(t_dup)) {
+            // we always walk the target forward, so we walk the whole alignment from its other end,
+            // which runs the query the other way
+            target_start = seqidx.nth_seq_length(target_idx) - target_end;
+            std::reverse(cigar.begin(), cigar.end());
+            q_rev = !q_rev;
+        }
+    }
+    return true;
+}
+
+static void report_bad_paf_record(const std::string& paf_file, uint64_t line_no) {
+    std::cerr << "[seqwish] ERROR: malformed PAF record on line " << line_no << " of " << paf_file
+              << ", expected 12 tab separated columns" << std::endl;
+}
+
 void unpack_paf_alignments(const std::string& paf_file,
                            mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
                            seqindex_t& seqidx,
+                           const match_list_t& match_list,
+                           match_set_t& match_set,
+                           const paf_filter_t& filter,
                            uint64_t min_match_len) {
     // go through the PAF file
-    igzstream paf_in(paf_file.c_str());
+    ipgzstream paf_in(paf_file.c_str());
     if (!paf_in.good()) assert("PAF is not good!");
-    uint64_t lines = std::count(std::istreambuf_iterator<char>(paf_in), 
-                                std::istreambuf_iterator<char>(), '\n');
+    uint64_t lines = 0;
+    // if we limit the records per query, we have to see all of them before we can decide which to keep
+    std::vector<bool> keep_line;
+    if (filter.max_per_query) {
+        // (query rank, inverted match count, line number) so that sorting puts the best records first
+        std::vector<std::tuple<uint64_t, uint64_t, uint64_t>> ranked;
+        std::string line;
+        while (std::getline(paf_in, line)) {
+            if (line.empty()) {
+                ++lines;
+                continue;
+            }
+            paf_row_t paf(line, false);
+            if (!paf.good()) {
+                report_bad_paf_record(paf_file, lines + 1);
+                exit(1);
+            }
+            if (filter.keep(paf)) {
+                ranked.push_back(std::make_tuple(seqidx.rank_of_seq_named(paf.query_sequence_name),
+                                                 std::numeric_limits<uint64_t>::max() - paf.num_matches,
+                                                 lines));
+            }
+            ++lines;
+        }
+        ips4o::parallel::sort(ranked.begin(), ranked.end());
+        keep_line.resize(lines);
+        uint64_t last_query = 0;
+        uint64_t kept = 0;
+        for (auto& r : ranked) {
+            if (std::get<0>(r) != last_query) {
+                last_query = std::get<0>(r);
+                kept = 0;
+            }
+            if (kept++ < filter.max_per_query) {
+                keep_line[std::get<2>(r)] = true;
+            }
+        }
+    } else {
+        const char* begin;
+        const char* end;
+        while (paf_in.next_chunk(begin, end)) {
+            lines += std::count(begin, end, '\n');
+        }
+    }
+    if (paf_in.bad()) exit(1); // the stream has said what was wrong with the input
     paf_in.close();
     paf_in.open(paf_file.c_str());
+    uint64_t next_line = 0;
+    // buffer appends per thread so that workers don't serialize on the tree writer
+    iitree_writer_t<uint64_t, pos_t> aln_writer(aln_iitree);
+    uint64_t first_bad_line = 0;
+    std::mutex bad_line_mutex;
+    // a lock of our own, rather than a named critical section, which would be shared with every other file being read
+    std::mutex paf_in_mutex;
 #pragma omp parallel for //schedule(dynamic) // why is this broken now?
     for (size_t i = 0; i < lines; ++i) {
         std::string line;
-#pragma omp critical (paf_in)
-        std::getline(paf_in, line);
-        paf_row_t paf(line);
+        uint64_t line_no;
+        {
+            std::lock_guard<std::mutex> guard(paf_in_mutex);
+            std::getline(paf_in, line);
+            line_no = next_line++;
+        }
+        if (line.empty()) continue;
+        // apply the record filters on the mandatory columns, before we look up names or parse the cigar
+        paf_row_t paf(line, false);
+        if (!paf.good()) {
+            // we can't leave the parallel loop, so we note the first bad record and report it once we're out
+            std::lock_guard<std::mutex> guard(bad_line_mutex);
+            if (!first_bad_line || line_no + 1 < first_bad_line) first_bad_line = line_no + 1;
+            continue;
+        }
+        if (!keep_line.empty() ? !keep_line[line_no] : !filter.keep(paf)) continue;
         size_t query_idx = seqidx.rank_of_seq_named(paf.query_sequence_name);
-        size_t query_len = seqidx.nth_seq_length(query_idx);
         size_t target_idx = seqidx.rank_of_seq_named(paf.target_sequence_name);
-        size_t target_len = seqidx.nth_seq_length(target_idx);
+        // drop pairs not in the match list before we pay for the cigar
+        if (!match_list.keep(query_idx, target_idx)) continue;
+        paf.parse_cigar(line);
         bool q_rev = !paf.query_target_same_strand;
-        size_t q_all_pos = (q_rev ? seqidx.pos_in_all_seqs(query_idx, paf.query_end, false) - 1
-                            : seqidx.pos_in_all_seqs(query_idx, paf.query_start, false));
-        size_t t_all_pos = seqidx.pos_in_all_seqs(target_idx, paf.target_start, false);
-        pos_t q_pos = make_pos_t(q_all_pos, q_rev);
-        pos_t t_pos = make_pos_t(t_all_pos, false);
-        for (auto& c : paf.cigar) {
-            switch (c.op) {
-            case 'M':
+        if (!onto_representatives(seqidx, query_idx, paf.query_start, paf.query_end, q_rev,
+                                  target_idx, paf.target_start, paf.target_end, paf.cigar)) continue;
+        unpack_matches(query_idx, paf.query_start, paf.query_end, q_rev,
+                       target_idx, paf.target_start, paf.cigar,
+                       seqidx, match_set, aln_writer, min_match_len);
+    }
+    if (paf_in.bad()) exit(1);
+    if (first_bad_line) {
+        report_bad_paf_record(paf_file, first_bad_line);
+        exit(1);
+    }
+    aln_writer.flush_all();
+}
+
+void unpack_sxs_alignments(const std::string& sxs_file,
+                           mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
+                           seqindex_t& seqidx,
+                           const match_list_t& match_list,
+                           match_set_t& match_set,
+                           const paf_filter_t& filter,
+                           uint64_t min_match_len) {
+    if (filter.max_per_query) {
+        std::cerr << "[seqwish] WARNING: the per-query alignment limit is not applied to SXS input " << sxs_file << std::endl;
+    }
+    ipgzstream sxs_in(sxs_file.c_str());
+    if (!sxs_in.good()) assert("SXS is not good!");
+    iitree_writer_t<uint64_t, pos_t> aln_writer(aln_iitree);
+    // records span several lines, so each thread pulls the lines of whole records off the stream until it runs dry,
+    // and parses them outside the lock, which is this file's alone
+    std::mutex sxs_in_mutex;
+#pragma omp parallel
+    {
+        std::vector<std::string> lines;
+        while (true) {
+            bool got_record;
             {
-                pos_t q_pos_match_start = q_pos;
-                pos_t t_pos_match_start = t_pos;
-                uint64_t match_len = 0;
-                auto add_match =
-                    [&](void) {
-                        if (match_len && match_len >= min_match_len) {
-                            if (is_rev(q_pos)) {
-                                pos_t x_pos = q_pos;
-                                decr_pos(x_pos); // to guard against underflow when our start is 0-, we need to decr in pos_t space
-                                aln_iitree.add(offset(x_pos), offset(q_pos_match_start)+1, make_pos_t(offset(t_pos)-1, true));
-                                aln_iitree.add(offset(t_pos_match_start), offset(t_pos), make_pos_t(offset(q_pos_match_start), true));
-                            } else {
-                                aln_iitree.add(offset(q_pos_match_start), offset(q_pos), t_pos_match_start);
-                                aln_iitree.add(offset(t_pos_match_start), offset(t_pos), q_pos_match_start);
-                            }
-                        }
-                    };
-                for (size_t i = 0; i < c.len; ++i) {
-                    if (seqidx.at_pos(q_pos) == seqidx.at_pos(t_pos)
-                        && offset(q_pos) != offset(t_pos)) { // guard against self mappings
-                        if (match_len == 0) {
-                            q_pos_match_start = q_pos;
-                            t_pos_match_start = t_pos;
-                        }
-                        ++match_len;
-                        incr_pos(q_pos);
-                        incr_pos(t_pos);
-                    } else {
-                        add_match();
-                        incr_pos(q_pos);
-                        incr_pos(t_pos);
-                        match_len = 0;
-                        // break out the last match
-                    }
-                }
-                // handle any last match
-                add_match();
-            }
-                break;
-            case 'I':
-                //std::cerr << "ins " << c.len << std::endl;
-                incr_pos(q_pos, c.len);
-                break;
-            case 'D':
-                //std::cerr << "del " << c.len << std::endl;
-                incr_pos(t_pos, c.len);
-                break;
-            default: break;
+                std::lock_guard<std::mutex> guard(sxs_in_mutex);
+                got_record = sxs_t::read_lines(sxs_in, lines);
             }
+            if (!got_record) break;
+            sxs_t aln(lines);
+            if (!aln.good()) break;
+            // the block length isn't recorded, but we can recover it from the cigar
+            uint64_t block_length = 0;
+            for (auto& c : aln.cigar) block_length += c.len;
+            if (!filter.keep(aln.num_matches, block_length, aln.mapping_quality)) continue;
+            size_t query_idx = seqidx.rank_of_seq_named(aln.query_sequence_name);
+            size_t target_idx = seqidx.rank_of_seq_named(aln.target_sequence_name);
+            if (!match_list.keep(query_idx, target_idx)) continue;
+            bool q_rev = aln.b_rev();
+            uint64_t query_start = q_rev ? aln.query_end : aln.query_start;
+            uint64_t query_end = q_rev ? aln.query_start : aln.query_end;
+            if (!onto_representatives(seqidx, query_idx, query_start, query_end, q_rev,
+                                      target_idx, aln.target_start, aln.target_end, aln.cigar)) continue;
+            unpack_matches(query_idx, query_start, query_end, q_rev,
+                           target_idx, aln.target_start, aln.cigar,
+                           seqidx, match_set, aln_writer, min_match_len);
+        }
+    }
+    if (sxs_in.bad()) exit(1); // the stream has said what was wrong with the input
+    aln_writer.flush_all();
+}
+
+void unpack_alignments(const std::vector<std::pair<std::string, uint64_t>>& files_and_min_lengths,
+                       mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
+                       seqindex_t& seqidx,
+                       const match_list_t& match_list,
+                       match_set_t& match_set,
+                       const paf_filter_t& filter,
+                       uint64_t min_match_len) {
+    int nthreads = get_thread_count();
+    int nfiles = files_and_min_lengths.size();
+    // each file is read through one stream, so we run a team per file and give each team its share of the threads
+    int outer_threads = std::max(1, std::min(nthreads, nfiles));
+    int inner_threads = std::max(1, nthreads / outer_threads);
+    int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(outer_threads)
+    for (int i = 0; i < nfiles; ++i) {
+        omp_set_num_threads(inner_threads);
+        auto& file = files_and_min_lengths[i].first;
+        uint64_t min_length = files_and_min_lengths[i].second;
+        if (!min_length) {
+            min_length = min_match_len;
         }
+        if (is_sxs_file(file)) {
+            unpack_sxs_alignments(file, aln_iitree, seqidx, match_list, match_set, filter, min_length);
+        } else {
+            unpack_paf_alignments(file, aln_iitree, seqidx, match_list, match_set, filter, min_length);
+        }
+    }
+    omp_set_max_active_levels(max_levels);
+}
+
+// the other half of a match pair as written by unpack_matches
+static match_t reciprocal_match(const match_t& m) {
+    uint64_t len = m.end - m.start;
+    if (!is_rev(m.pos)) {
+        return { offset(m.pos), offset(m.pos) + len, make_pos_t(m.start, false) };
+    } else {
+        return { offset(m.pos) + 1 - len, offset(m.pos) + 1, make_pos_t(m.end - 1, true) };
     }
 }
 
-/*
-void filter_alignments(mmmulti::map<pos_t, aln_pos_t>& aln_mm,
-                       mmmulti::map<pos_t, pos_t>& aln_filt_mm,
-                       uint64_t aln_min_length,
+void filter_alignments(mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
+                       mmmulti::iitree<uint64_t, pos_t>& aln_filt_iitree,
                        uint64_t aln_keep_n_longest,
-                       seqindex_t& seqidx) {
-    for (size_t i = 1; i <= seqidx.seq_length(); ++i) {
-        std::vector<aln_pos_t> at_pos = aln_mm.unique_values(i);
-        std::sort(at_pos.begin(), at_pos.end(), [&](const aln_pos_t& a, const aln_pos_t& b){ return a.aln_length > b.aln_length; });
-        uint64_t to_keep = (aln_keep_n_longest ? std::min(aln_keep_n_longest, (uint64_t)at_pos.size()) : at_pos.size());
-        //std::cerr << "keep at " << i << ": ";
-        //for (auto& k : at_pos) std::cerr << " " << k.aln_length;  std::cerr << std::endl;
-        for (size_t j = 0; j < to_keep; ++j) {
-            auto& a = at_pos[j];
-            if (a.aln_length < aln_min_length) break;
-            aln_filt_mm.append(i, at_pos[j].pos);
+                       const seqindex_t& seqidx) {
+    uint64_t n_matches = aln_iitree.size();
+    atomicbitvector::atomic_bv_t keep_bv(n_matches);
+    uint64_t seq_length = seqidx.seq_length();
+    uint64_t chunk_size = 1 << 20;
+    uint64_t n_chunks = (seq_length + chunk_size - 1) / chunk_size;
+    // sweep each chunk of Q, tracking the set of matches over the current position ordered by length
+#pragma omp parallel for schedule(dynamic)
+    for (uint64_t c = 0; c < n_chunks; ++c) {
+        uint64_t chunk_start = c * chunk_size;
+        uint64_t chunk_end = std::min(chunk_start + chunk_size, seq_length);
+        std::vector<size_t> ovlp;
+        aln_iitree.overlap(chunk_start, chunk_end, ovlp);
+        if (ovlp.empty()) continue;
+        // (position, is_start, match index), with ends sorting before starts at the same position
+        std::vector<std::tuple<uint64_t, bool, size_t>> events;
+        events.reserve(ovlp.size() * 2);
+        for (auto& idx : ovlp) {
+            events.push_back(std::make_tuple(std::max(aln_iitree.start(idx), chunk_start), true, idx));
+            events.push_back(std::make_tuple(std::min(aln_iitree.end(idx), chunk_end), false, idx));
+        }
+        std::sort(events.begin(), events.end());
+        // (inverted length, match index) so that the longest matches come first
+        std::set<std::pair<uint64_t, size_t>> active;
+        auto longest_first = [&](size_t idx) {
+            uint64_t len = aln_iitree.end(idx) - aln_iitree.start(idx);
+            return std::make_pair(std::numeric_limits<uint64_t>::max() - len, idx);
+        };
+        for (uint64_t e = 0; e < events.size(); ) {
+            uint64_t pos = std::get<0>(events[e]);
+            // apply every change at this position before we look at the active set
+            for ( ; e < events.size() && std::get<0>(events[e]) == pos; ++e) {
+                size_t idx = std::get<2>(events[e]);
+                if (std::get<1>(events[e])) {
+                    active.insert(longest_first(idx));
+                } else {
+                    active.erase(longest_first(idx));
+                }
+            }
+            uint64_t kept = 0;
+            for (auto& a : active) {
+                if (kept++ == aln_keep_n_longest) break;
+                keep_bv.set(a.second);
+            }
+        }
+    }
+    // write out the kept matches and the partners of kept matches
+    iitree_writer_t<uint64_t, pos_t> aln_filt_writer(aln_filt_iitree);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (uint64_t idx = 0; idx < n_matches; ++idx) {
+        match_t m = get_match(aln_iitree, idx);
+        bool keep = keep_bv.test(idx);
+        if (!keep) {
+            match_t r = reciprocal_match(m);
+            std::vector<size_t> ovlp;
+            aln_iitree.overlap(r.start, r.end, ovlp);
+            for (auto& j : ovlp) {
+                if (keep_bv.test(j) && get_match(aln_iitree, j) == r) {
+                    keep = true;
+                    break;
+                }
+            }
+        }
+        if (keep) {
+            aln_filt_writer.add(m.start, m.end, m.pos);
         }
     }
-    aln_filt_mm.index(seqidx.seq_length());
+    aln_filt_writer.index();
 }
-*/
 
 }
@@ -4,29 +4,72 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <tuple>
+#include <limits>
+#include <set>
+#include <mutex>
 #include "paf.hpp"
 #include "sxs.hpp"
 #include "mmmultimap.hpp"
 #include "mmiitree.hpp"
+#include "iitree_writer.hpp"
 #include "seqindex.hpp"
-#include "gzstream.h"
+#include "matchlist.hpp"
+#include "matchset.hpp"
+#include "pgzstream.hpp"
 #include "pos.hpp"
+#include "match.hpp"
+#include "ips4o.hpp"
+#include "atomic_bitvector.hpp"
 
 namespace seqwish {
 
 
+// walk the cigar of one alignment, writing its exact matches and their reciprocals into the tree
+void unpack_matches(size_t query_idx,
+                    uint64_t query_start,
+                    uint64_t query_end,
+                    bool q_rev,
+                    size_t target_idx,
+                    uint64_t target_start,
+                    const cigar_t& cigar,
+                    const seqindex_t& seqidx,
+                    match_set_t& match_set,
+                    iitree_writer_t<uint64_t, pos_t>& aln_writer,
+                    uint64_t min_match_len);
+
 void unpack_paf_alignments(const std::string& paf_file,
                            mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
                            seqindex_t& seqidx,
+                           const match_list_t& match_list,
+                           match_set_t& match_set,
+                           const paf_filter_t& filter,
+                           uint64_t min_match_len);
+
+void unpack_sxs_alignments(const std::string& sxs_file,
+                           mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
+                           seqindex_t& seqidx,
+                           const match_list_t& match_list,
+                           match_set_t& match_set,
+                           const paf_filter_t& filter,
                            uint64_t min_match_len);
 
-/*
-void filter_alignments(mmmulti::map<pos_t, aln_pos_t>& aln_mm,
-                       mmmulti::map<pos_t, pos_t>& aln_filt_mm,
-                       uint64_t aln_min_length,
+// ingest several alignment files (PAF or SXS) concurrently, splitting our threads between them
+// each file may carry its own minimum match length, falling back to min_match_len when it is 0
+void unpack_alignments(const std::vector<std::pair<std::string, uint64_t>>& files_and_min_lengths,
+                       mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
+                       seqindex_t& seqidx,
+                       const match_list_t& match_list,
+                       match_set_t& match_set,
+                       const paf_filter_t& filter,
+                       uint64_t min_match_len);
+
+// keep only the aln_keep_n_longest longest matches overlapping each position in Q
+// a match is kept together with its reciprocal, so that the closure sees it from both sides
+void filter_alignments(mmmulti::iitree<uint64_t, pos_t>& aln_iitree,
+                       mmmulti::iitree<uint64_t, pos_t>& aln_filt_iitree,
                        uint64_t aln_keep_n_longest,
-                       seqindex_t& seqidx);
-*/
+                       const seqindex_t& seqidx);
 
 }
 
@@ -5,11 +5,13 @@
 #include "sdsl/bit_vectors.hpp"
 #include "seqindex.hpp"
 #include "mmiitree.hpp"
+#include "iitree_cursor.hpp"
 #include "pos.hpp"
 
 namespace seqwish {
 
-
+// the closure marks node boundaries as it flushes its ranges; this separate pass over the paths
+// finds the same boundaries and now only runs under -d, to cross-check them
 void compact_nodes(
     seqindex_t& seqidx,
     size_t graph_size,
@@ -2,164 +2,269 @@
 
 namespace seqwish {
 
+namespace {
+
+// append the decimal digits of v, without going through a stream
+inline void append_uint(std::string& buf, uint64_t v) {
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    buf.append(p, digits + sizeof(digits) - p);
+}
+
+// format blocks [0, n_blocks) on all threads, each into a state T that its thread reuses,
+// and emit them in order, while the other threads keep formatting
+template <typename T, typename F, typename E>
+void for_each_block_ordered(uint64_t n_blocks, const F& format, const E& emit) {
+#pragma omp parallel
+    {
+    T state;
+#pragma omp for ordered schedule(dynamic)
+    for (uint64_t b = 0; b < n_blocks; ++b) {
+        format(b, state);
+#pragma omp ordered
+        emit(b, state);
+    }
+    }
+}
+
+// format items [0, n) in blocks of block_size on all threads, writing the blocks out in order
+template <typename F>
+void write_blocks(std::ostream& out, uint64_t n, uint64_t block_size, const F& format) {
+    for_each_block_ordered<std::string>(
+        (n + block_size - 1) / block_size,
+        [&](uint64_t b, std::string& buf) {
+            buf.clear();
+            format(b * block_size, std::min(n, (b + 1) * block_size), buf);
+        },
+        [&](uint64_t b, std::string& buf) {
+            out.write(buf.data(), buf.size());
+        });
+}
+
+}
+
 void emit_gfa(std::ostream& out,
               size_t graph_length,
               const std::string& seq_v_file,
               mmmulti::iitree<uint64_t, pos_t>& node_iitree,
               mmmulti::iitree<uint64_t, pos_t>& path_iitree,
-              const sdsl::sd_vector<>& seq_id_cbv,
-              const sdsl::sd_vector<>::rank_1_type& seq_id_cbv_rank,
-              const sdsl::sd_vector<>::select_1_type& seq_id_cbv_select,
+              const node_index_t& seq_id_cbv,
               seqindex_t& seqidx,
-              mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset) {
+              const graph_adjacency_t& adjacency,
+              gfa_path_style_t path_style) {
 
-    out << "H" << "\t" << "VN:Z:1.0" << std::endl;
+    // walks are new in GFA 1.1
+    out << "H" << "\t" << (path_style == gfa_walks ? "VN:Z:1.1" : "VN:Z:1.0") << "\n";
     int seq_v_fd = -1;
     char* seq_v_buf = nullptr;
     size_t seq_v_filesize = mmap_open(seq_v_file, seq_v_buf, seq_v_fd);
     // write the nodes
     // these are delimited in the seq_v_file by the markers in seq_id_civ
-    auto show_links = [&](const pos_t& p) { std::cerr << pos_to_string(p) << " " << pos_to_string(make_pos_t(seq_id_cbv_rank(offset(p)), is_rev(p))) << ", "; };
-    size_t n_nodes = seq_id_cbv_rank(seq_id_cbv.size()-1);
-//#pragma omp parallel for
-    for (size_t id = 1; id <= n_nodes; ++id) {
-        //std::cerr << "id " << id << " n_nodes " << n_nodes << std::endl;
-        size_t node_start = seq_id_cbv_select(id);
-        //size_t node_length = (id==n_nodes ? seq_id_cbv.size() : seq_id_cbv_select(id+1)) - node_start;
-        size_t node_length = seq_id_cbv_select(id+1) - node_start;
-        //std::cerr << id << " "  << node_start << " " << node_length << std::endl;
-        std::string seq; seq.resize(node_length);
-        memcpy((void*)seq.c_str(), &seq_v_buf[node_start], node_length);
-//#pragma omp critical (out)
-        out << "S" << "\t" << id << "\t" << seq << std::endl;
-        // get the links of this node
-        // to the forward or reverse start
-        /*
-        pos_t node_start_fwd = make_pos_t(node_start+1, false);
-        pos_t node_end_fwd = make_pos_t(node_start+node_length, false);
-        // from the forward or reverse end
-        pos_t node_start_rev = make_pos_t(node_start+node_length, true);
-        pos_t node_end_rev = make_pos_t(node_start+1, true);
-        */
-
-        /*
-        std::cerr << "node extents "
-                  << pos_to_string(node_start_fwd) << " "
-                  << pos_to_string(node_end_fwd) << " "
-                  << pos_to_string(node_start_rev) << " "
-                  << pos_to_string(node_end_rev) << std::endl;
-        std::cerr << "things to this node fwd" << " ";
-        link_rev_mm.for_values_of(node_start_fwd, show_links);
-        std::cerr << std::endl;
-        std::cerr << "things to this node rev" << " ";
-        link_rev_mm.for_values_of(node_start_rev, show_links);
-        std::cerr << std::endl;
-        std::cerr << "things from this node fwd" << " ";
-        link_fwd_mm.for_values_of(node_end_fwd, show_links);
-        std::cerr << std::endl;
-        std::cerr << "things from this node rev" << " ";
-        link_fwd_mm.for_values_of(node_end_rev, show_links);
-        std::cerr << std::endl;
-        */
-
-    }
+    size_t n_nodes = seq_id_cbv.rank(seq_id_cbv.size()-1);
+    write_blocks(out, n_nodes, 1 << 14, [&](uint64_t begin, uint64_t end, std::string& buf) {
+            // node id is 1-based, as is select
+            size_t node_start = seq_id_cbv.select(begin+1);
+            for (uint64_t id = begin+1; id <= end; ++id) {
+                size_t node_end = seq_id_cbv.select(id+1);
+                buf.append("S\t");
+                append_uint(buf, id);
+                buf.push_back('\t');
+                buf.append(seq_v_buf + node_start, node_end - node_start);
+                buf.push_back('\n');
+                node_start = node_end;
+            }
+        });
 
-    auto print_link = [&out](const std::pair<pos_t, pos_t>& p) {
-        auto& from = p.first;
-        auto& to = p.second;
-        if (from && to) {
-            out << "L" << "\t"
-                << offset(from) << "\t" << (is_rev(from)?"-":"+") << "\t"
-                << offset(to) << "\t" << (is_rev(to)?"-":"+") << "\t"
-                << "0M" << std::endl;
-        }
-    };
-    link_mmset.for_each_unique_value(print_link);
+    // write the links, a block of oriented node handles at a time
+    write_blocks(out, adjacency.handle_count(), 1 << 15, [&](uint64_t begin, uint64_t end, std::string& buf) {
+            adjacency.for_each_link_in(begin, end, [&](const pos_t& from, const pos_t& to) {
+                    buf.append("L\t");
+                    append_uint(buf, offset(from));
+                    buf.append(is_rev(from) ? "\t-\t" : "\t+\t");
+                    append_uint(buf, offset(to));
+                    buf.append(is_rev(to) ? "\t-\t0M\n" : "\t+\t0M\n");
+                });
+        });
 
     // write the paths
-    // iterate over the sequence positions, emitting a node at every edge crossing
+    // each path is cut into chunks of at most path_chunk_bp, which are walked on all threads and written in order,
+    // so no path is ever held whole; blocks group chunks, and with them short paths, up to about as many bases
+    const uint64_t path_chunk_bp = 1 << 20;
     size_t num_seqs = seqidx.n_seqs();
-//#pragma omp parallel for
+    // the first chunk of each block, as (sequence, offset in it)
+    std::vector<std::pair<size_t, uint64_t>> block_starts;
+    uint64_t block_bp = path_chunk_bp;
     for (size_t i = 1; i <= num_seqs; ++i) {
-        size_t j = seqidx.nth_seq_offset(i);
-        size_t seq_len = seqidx.nth_seq_length(i);
-        size_t k = j + seq_len;
-        //std::cerr << seqidx.nth_name(i) << " " << seqidx.nth_seq_length(i) << " " << j << " " << k << std::endl;
-        std::vector<pos_t> path_v;
-        uint64_t seen_bp = 0;
-        uint64_t accumulated_bp = 0;
-        while (j < k) {
-            std::vector<size_t> ovlp;
-            path_iitree.overlap(j, j+1, ovlp);
-            // each input base should only map one place in the graph
-            assert(ovlp.size() == 1);
-            size_t idx = ovlp.front();
-            uint64_t ovlp_start_in_q = path_iitree.start(idx);
-            uint64_t ovlp_end_in_q = path_iitree.end(idx);
-            pos_t pos_start_in_s = path_iitree.data(idx);
-            bool match_is_rev = is_rev(pos_start_in_s);
-            // iterate through the nodes in this range
-            uint64_t length = ovlp_end_in_q - ovlp_start_in_q;
-            //std::cerr << "overlap in path_iitree " << ovlp_start_in_q << ".." << ovlp_end_in_q << " " << pos_to_string(pos_start_in_s) << std::endl;
-            pos_t q = make_pos_t(ovlp_start_in_q, false);
-            pos_t p = pos_start_in_s;
-            // validate the path
-            // for each base in the range pointed to by the match, check that the input sequence we're processing matches the graph
-            for (uint64_t k = 0; k < length; ++k) {
-                if (seq_id_cbv[offset(p)]) {
-                    uint64_t node_id = seq_id_cbv_rank(offset(p)+1);
-                    //std::cerr << "got to node " << node_id << (match_is_rev ? "-" : "+") << std::endl;
-                    path_v.push_back(make_pos_t(node_id, match_is_rev));
+        uint64_t seq_len = seqidx.nth_seq_length(i);
+        uint64_t begin = 0;
+        do {
+            if (block_bp >= path_chunk_bp) {
+                block_starts.push_back(std::make_pair(i, begin));
+                block_bp = 0;
+            }
+            uint64_t end = std::min(seq_len, begin + path_chunk_bp);
+            // count every chunk, so runs of tiny sequences are still split up
+            block_bp += end - begin + 1;
+            begin = end;
+        } while (begin < seq_len);
+    }
+    block_starts.push_back(std::make_pair(num_seqs + 1, 0));
+    // the steps of each chunk are formatted with their separators, and the line around them is added in order
+    struct chunk_t {
+        size_t seq;
+        uint64_t begin;
+        uint64_t end;
+        uint64_t text_end;
+        uint64_t n_steps;
+    };
+    struct path_block_t {
+        std::string text;
+        std::vector<chunk_t> chunks;
+        std::vector<pos_t> steps;
+        std::unique_ptr<iitree_cursor_t<uint64_t, pos_t>> cursor;
+    };
+    // collect the node steps of the input bases [q_begin, q_end) of sequence i
+    auto walk_chunk = [&](size_t i, uint64_t q_begin, uint64_t q_end, bool validate, path_block_t& block) {
+            // the path intervals of a sequence follow each other in the tree, so we sweep through them
+            auto& cursor = *block.cursor;
+            std::string seq = validate ? seqidx.subseq(q_begin, q_end - q_begin) : std::string();
+            uint64_t j = q_begin;
+            while (j < q_end) {
+                cursor.seek(j);
+                uint64_t ovlp_end_in_q = std::min(cursor.end(), q_end);
+                pos_t p = cursor.data();
+                bool match_is_rev = is_rev(p);
+                incr_pos(p, j - cursor.start());
+                // for each base in the range, note the nodes we enter and check that the graph spells the input
+                for ( ; j < ovlp_end_in_q; ++j) {
+                    if (seq_id_cbv[offset(p)]) {
+                        uint64_t node_id = seq_id_cbv.rank(offset(p)+1);
+                        block.steps.push_back(make_pos_t(node_id, match_is_rev));
+                    }
+                    if (validate) {
+                        char c = seq_v_buf[offset(p)];
+                        if (is_rev(p)) c = dna_reverse_complement(c);
+                        if (seq[j - q_begin] != c) {
+                            std::cerr << "GRAPH BROKEN @ "
+                                      << seqidx.nth_name(i) << " " << pos_to_string(make_pos_t(j, false)) << " -> "
+                                      << pos_to_string(p) << std::endl;
+                            assert(false);
+                            exit(1); // for release builds
+                        }
+                    }
+                    incr_pos(p, 1);
                 }
-                /*else if (match_is_rev && seq_id_cbv[offset(p)]) {
-                    uint64_t node_id = seq_id_cbv_rank(offset(p)-1);
-                    std::cerr << "got to node " << node_id << "-" << std::endl;
-                    path_v.push_back(make_pos_t(node_id, match_is_rev));
+            }
+        };
+    auto format_block = [&](uint64_t b, path_block_t& block) {
+            if (!block.cursor) {
+                block.cursor.reset(new iitree_cursor_t<uint64_t, pos_t>(path_iitree));
+            }
+            block.text.clear();
+            block.chunks.clear();
+            size_t i = block_starts[b].first;
+            uint64_t begin = block_starts[b].second;
+            while (std::make_pair(i, begin) < block_starts[b+1]) {
+                uint64_t seq_len = seqidx.nth_seq_length(i);
+                uint64_t end = std::min(seq_len, begin + path_chunk_bp);
+                uint64_t j = seqidx.nth_seq_offset(i);
+                block.steps.clear();
+                pos_t rep = seqidx.duplicate_of(i);
+                if (!rep) {
+                    walk_chunk(i, j + begin, j + end, true, block);
+                } else if (!is_rev(rep)) {
+                    // a collapsed duplicate follows its representative's nodes, which were checked when indexing
+                    uint64_t r = seqidx.nth_seq_offset(offset(rep));
+                    walk_chunk(offset(rep), r + begin, r + end, false, block);
+                } else {
+                    // or walks them backwards, flipping each step
+                    uint64_t r = seqidx.nth_seq_offset(offset(rep));
+                    walk_chunk(offset(rep), r + seq_len - end, r + seq_len - begin, false, block);
+                    std::reverse(block.steps.begin(), block.steps.end());
+                    for (auto& p : block.steps) {
+                        p = make_pos_t(offset(p), !is_rev(p));
+                    }
+                }
+                for (auto& p : block.steps) {
+                    if (path_style == gfa_walks) {
+                        block.text.push_back(is_rev(p) ? '<' : '>');
+                        append_uint(block.text, offset(p));
+                    } else {
+                        block.text.push_back(',');
+                        append_uint(block.text, offset(p));
+                        block.text.push_back(is_rev(p) ? '-' : '+');
+                    }
                 }
-                */
-                char c = seq_v_buf[offset(p)];
-                if (is_rev(p)) c = dna_reverse_complement(c);
-                //std::cerr << pos_to_string(q) << " -> " << pos_to_string(p) << " " << seqidx.at_pos(q) << " vs " << c << std::endl;
-                if (seqidx.at_pos(q) != c) {
-                    std::cerr << "GRAPH BROKEN @ "
-                        << seqidx.nth_name(i) << " " << pos_to_string(q) << " -> "
-                        << pos_to_string(q) << std::endl;
-                    assert(false);
-                    exit(1); // for release builds
+                block.chunks.push_back({i, begin, end, block.text.size(), block.steps.size()});
+                if (end == seq_len) {
+                    ++i;
+                    begin = 0;
+                } else {
+                    begin = end;
                 }
-                incr_pos(p, 1);
-                incr_pos(q, 1);
             }
-            seen_bp += length;
-            j = ovlp_end_in_q;
-        }
-        if (seen_bp != seq_len) {
-            std::cerr << "length for " << seqidx.nth_name(i) << ", expected " << seqidx.nth_seq_length(i) << " but got " << accumulated_bp << std::endl;
-            assert(false);
-            exit(1); // for release builds
-        }
-        std::stringstream cigarss;
-        std::stringstream pathss;
-
-        for (auto& p : path_v) {
-            pathss << pos_to_string(p) << ",";
-        }
-        pathss.seekp(-1, pathss.cur); // trim the last ","
-        cigarss << "*";
-        if (path_v.size() > 2) {
-            for (uint64_t q = 0; q < path_v.size()-2; ++q) {
-                cigarss << ",*";
+        };
+    // the P line overlaps are one "*" per pair of steps, which we write a piece at a time
+    std::string overlaps;
+    for (uint64_t q = 0; q < 4096; ++q) overlaps.append(",*");
+    uint64_t path_steps = 0;
+    auto write_block = [&](uint64_t b, path_block_t& block) {
+            uint64_t text_begin = 0;
+            for (auto& chunk : block.chunks) {
+                uint64_t seq_len = seqidx.nth_seq_length(chunk.seq);
+                // a walk needs at least one step, so empty sequences have none
+                if (path_style == gfa_walks && seq_len == 0) continue;
+                if (chunk.begin == 0) {
+                    path_steps = 0;
+                    std::string head;
+                    if (path_style == gfa_walks) {
+                        // PanSN names, sample#haplotype#contig, give the walk its sample and haplotype
+                        const std::string name = seqidx.nth_name(chunk.seq);
+                        size_t h1 = name.find('#');
+                        size_t h2 = h1 == std::string::npos ? h1 : name.find('#', h1 + 1);
+                        head.append("W\t");
+                        if (h2 == std::string::npos) {
+                            head.append(name).append("\t0\t").append(name);
+                        } else {
+                            head.append(name, 0, h1).push_back('\t');
+                            head.append(name, h1 + 1, h2 - h1 - 1).push_back('\t');
+                            head.append(name, h2 + 1, std::string::npos);
+                        }
+                        head.append("\t0\t");
+                        append_uint(head, seq_len);
+                        head.push_back('\t');
+                    } else {
+                        head.append("P\t");
+                        head.append(seqidx.nth_name(chunk.seq));
+                        head.push_back('\t');
+                    }
+                    out.write(head.data(), head.size());
+                }
+                // the first step of a P line has no separator before it
+                uint64_t skip = path_style != gfa_walks && path_steps == 0 && chunk.n_steps ? 1 : 0;
+                out.write(block.text.data() + text_begin + skip, chunk.text_end - text_begin - skip);
+                text_begin = chunk.text_end;
+                path_steps += chunk.n_steps;
+                if (chunk.end == seq_len) {
+                    if (path_style == gfa_walks) {
+                        out.write("\n", 1);
+                    } else {
+                        out.write(path_steps ? "\t*" : "*", path_steps ? 2 : 1);
+                        if (path_style == gfa_paths_overlaps) {
+                            for (uint64_t q = 2; q < path_steps; q += overlaps.size() / 2) {
+                                out.write(overlaps.data(), 2 * std::min(path_steps - q, (uint64_t)overlaps.size() / 2));
+                            }
+                        }
+                        out.write("\n", 1);
+                    }
+                }
             }
-        }
-        pathss << '\t';
-        //cigarss.seekp(-1, cigarss.cur);
-        cigarss << std::endl;
-//#pragma omp critical (out)
-        out << "P" << "\t"
-            << seqidx.nth_name(i) << "\t"
-            << pathss.str()
-            << cigarss.str();
-    }
+        };
+    for_each_block_ordered<path_block_t>(block_starts.size() - 1, format_block, write_block);
 
     mmap_close(seq_v_buf, seq_v_fd, seq_v_filesize);
 
@@ -3,25 +3,33 @@
 
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <vector>
 #include "mmiitree.hpp"
-#include "mmmultiset.hpp"
+#include "iitree_cursor.hpp"
+#include "adjacency.hpp"
 #include "seqindex.hpp"
+#include "nodeindex.hpp"
 #include "pos.hpp"
 #include "mmap.hpp"
 
 namespace seqwish {
 
+// how paths are written: as P lines with a "*" overlap between each pair of steps, as P lines with a single "*"
+// standing for all of their overlaps, or as GFA 1.1 W lines, which have no overlaps
+enum gfa_path_style_t { gfa_paths_overlaps, gfa_paths_no_overlaps, gfa_walks };
 
 void emit_gfa(std::ostream& out,
               size_t graph_length,
               const std::string& seq_v_file,
               mmmulti::iitree<uint64_t, pos_t>& node_iitree,
               mmmulti::iitree<uint64_t, pos_t>& path_iitree,
-              const sdsl::sd_vector<>& seq_id_cbv,
-              const sdsl::sd_vector<>::rank_1_type& seq_id_cbv_rank,
-              const sdsl::sd_vector<>::select_1_type& seq_id_cbv_select,
+              const node_index_t& seq_id_cbv,
               seqindex_t& seqidx,
-              mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset);
+              const graph_adjacency_t& adjacency,
+              gfa_path_style_t path_style);
 
 }
 
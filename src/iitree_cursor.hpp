@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include "mmiitree.hpp"
+
+namespace seqwish {
+
+// walks a tree of disjoint intervals, like the path_iitree over an input sequence, in order of position
+// the tree keeps its intervals sorted by start, so the one following the current interval is the next in the array
+// stepping onto it costs a comparison, and only jumping elsewhere costs a tree search
+// each thread should use its own cursor
+template <typename S, typename T>
+class iitree_cursor_t {
+
+private:
+
+    mmmulti::iitree<S, T>& tree;
+    size_t n;
+    size_t idx;
+    std::vector<size_t> ovlp; // reused by searches, so walking doesn't allocate
+
+public:
+
+    iitree_cursor_t(mmmulti::iitree<S, T>& t) : tree(t), n(t.size()), idx(t.size()) { }
+
+    // move to the interval containing pos
+    void seek(const S& pos) {
+        if (idx + 1 < n && tree.start(idx + 1) == pos) {
+            ++idx;
+        } else if (idx >= n || pos < tree.start(idx) || pos >= tree.end(idx)) {
+            ovlp.clear();
+            tree.overlap(pos, pos + 1, ovlp);
+            // each input base should only map one place in the graph
+            assert(ovlp.size() == 1);
+            idx = ovlp.front();
+        }
+    }
+    S start(void) const { return tree.start(idx); }
+    S end(void) const { return tree.end(idx); }
+    T data(void) const { return tree.data(idx); }
+
+};
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <map>
+#include <memory>
+#include <omp.h>
+#include "mmiitree.hpp"
+#include "threads.hpp"
+
+namespace seqwish {
+
+// collects interval appends into per-thread buffers and hands them to the shared iitree in batches
+// this keeps parallel writers off the tree's single append path except once per batch
+template <typename S, typename T>
+class iitree_writer_t {
+
+private:
+
+    struct interval_t { S start; S end; T data; };
+    mmmulti::iitree<S, T>& tree;
+    std::vector<std::vector<interval_t>> buffers;
+    size_t batch_size;
+    std::mutex& tree_mutex;
+
+    // one lock per tree, shared by every writer feeding it, as several may do so from concurrent teams
+    static std::mutex& mutex_for(const mmmulti::iitree<S, T>& t) {
+        static std::mutex locks_mutex;
+        static std::map<const void*, std::unique_ptr<std::mutex>> locks;
+        std::lock_guard<std::mutex> guard(locks_mutex);
+        auto& m = locks[&t];
+        if (!m) m.reset(new std::mutex());
+        return *m;
+    }
+
+    void flush(std::vector<interval_t>& buffer) {
+        if (buffer.empty()) return;
+        {
+            std::lock_guard<std::mutex> guard(tree_mutex);
+            for (auto& i : buffer) {
+                tree.add(i.start, i.end, i.data);
+            }
+        }
+        buffer.clear();
+    }
+
+public:
+
+    // one buffer per openmp thread, or per worker id when tid is given explicitly to add
+    iitree_writer_t(mmmulti::iitree<S, T>& t, size_t n_buffers = get_thread_count(), size_t batch = 1 << 16)
+        : tree(t), buffers(n_buffers), batch_size(batch), tree_mutex(mutex_for(t)) {
+        for (auto& b : buffers) b.reserve(batch_size);
+    }
+
+    ~iitree_writer_t(void) { flush_all(); }
+
+    void add(const S& start, const S& end, const T& data) {
+        add(omp_get_thread_num(), start, end, data);
+    }
+
+    void add(size_t tid, const S& start, const S& end, const T& data) {
+        auto& buffer = buffers[tid];
+        buffer.push_back({start, end, data});
+        if (buffer.size() >= batch_size) {
+            flush(buffer);
+        }
+    }
+
+    // must be called outside of any parallel region, before the tree is indexed
+    void flush_all(void) {
+        for (auto& b : buffers) {
+            flush(b);
+        }
+    }
+
+    // flush outstanding buffers and build the tree index
+    void index(void) {
+        flush_all();
+        tree.index();
+    }
+
+};
+
+}
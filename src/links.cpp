@@ -5,24 +5,30 @@ namespace seqwish {
 void derive_links(seqindex_t& seqidx,
                   mmmulti::iitree<uint64_t, pos_t>& node_iitree,
                   mmmulti::iitree<uint64_t, pos_t>& path_iitree,
-                  const sdsl::sd_vector<>& seq_id_cbv,
-                  const sdsl::sd_vector<>::rank_1_type& seq_id_cbv_rank,
-                  const sdsl::sd_vector<>::select_1_type& seq_id_cbv_select,
+                  const node_index_t& seq_id_cbv,
                   mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset) {
     // for each marked node
     // determine our edge context using the node_iitree and path_iitree
     // and write it into the mmset
-    size_t n_nodes = seq_id_cbv_rank(seq_id_cbv.size()-1);
+    size_t n_nodes = seq_id_cbv.rank(seq_id_cbv.size()-1);
     //std::cerr << seq_id_cbv << std::endl;
     /*
     for (size_t i = 0; i < seq_id_cbv.size(); ++i) {
-        std::cerr << i << " rank " << seq_id_cbv_rank(i) << std::endl;
+        std::cerr << i << " rank " << seq_id_cbv.rank(i) << std::endl;
     }
     */
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel
+    {
+    // overlaps of neighboring nodes tend to fall in the same input sequences
+    seq_cursor_t seq_cursor(seqidx);
+    // every path through a node repeats its links, so we collect them per node and only write the distinct ones
+    // all the links we find for a node start from it, so these are unique across the whole graph
+    std::vector<std::pair<pos_t, pos_t>> node_links;
+#pragma omp for schedule(dynamic)
     for (size_t id = 1; id <= n_nodes; ++id) {
-        uint64_t node_start_in_s = seq_id_cbv_select(id); // select is 1-based
-        uint64_t node_end_in_s = seq_id_cbv_select(id+1);
+        node_links.clear();
+        uint64_t node_start_in_s = seq_id_cbv.select(id); // select is 1-based
+        uint64_t node_end_in_s = seq_id_cbv.select(id+1);
         //std::cerr << "links for node " << id << " start " << node_start_in_s << " end " << node_end_in_s << std::endl;
         // find the things on both sides of our node by looking in the node_iitree, finding what bits of the paths (in Q)
         // are there, and seeing what's on either side of them to decide what links we need
@@ -42,16 +48,14 @@ void derive_links(seqindex_t& seqidx,
             // determine which sequence we're in
             // find its boundaries
             bool curr_step_is_rev = is_rev(pos_start_in_q);
-            uint64_t start_in_q = (curr_step_is_rev ? offset(pos_end_in_q)+1 : offset(pos_start_in_q));
+            // a reverse range ending at the first base of Q has its end before 0, so we count back from the start
+            uint64_t start_in_q = (curr_step_is_rev ? offset(pos_start_in_q)+1 - (node_end_in_s - node_start_in_s) : offset(pos_start_in_q));
             uint64_t end_in_q = (curr_step_is_rev ? offset(pos_start_in_q)+1 : offset(pos_end_in_q));
             //std::cerr << "start_in_q " << start_in_q << " end_in_q " << end_in_q << std::endl;
-            uint64_t seq_id = seqidx.seq_id_at(start_in_q);
-            uint64_t id_end = seqidx.seq_id_at(end_in_q-1);
-            //std::cerr << "sequence id at start " << seq_id << " and end " << id_end << std::endl;
-            assert(seq_id == id_end);
-            
-            uint64_t seq_start = seqidx.nth_seq_offset(seq_id);
-            uint64_t seq_end = seq_start + seqidx.nth_seq_length(seq_id);
+            seq_cursor.seek(start_in_q);
+            // the range can't cross into the next sequence
+            assert(end_in_q <= seq_cursor.seq_end());
+            uint64_t seq_end = seq_cursor.seq_end();
             //std::cerr << "seq boundaries " << seq_start << "-" << seq_end << std::endl;
             std::vector<size_t> path_before_ovlp, path_after_ovlp;
             // and only consider cases where we'd be within the boundaries
@@ -78,7 +82,7 @@ void derive_links(seqindex_t& seqidx,
                     //<< " prev pos_end_in_s " << pos_to_string(pos_end_in_s)
                     //<< " node boundaries " << node_start_in_s << ".." << node_end_in_s << std::endl;
                     // find which node we're in here, and record a link
-                    uint64_t prev_id = seq_id_cbv_rank(offset(pos_end_in_s)+1);
+                    uint64_t prev_id = seq_id_cbv.rank(offset(pos_end_in_s)+1);
                     //std::cerr << "id? " << prev_id << std::endl;
                     // relative orientations please
                     bool prev_step_is_rev = is_rev(pos_end_in_s);
@@ -108,7 +112,7 @@ void derive_links(seqindex_t& seqidx,
                               << " node boundaries " << node_start_in_s << ".." << node_end_in_s << std::endl;
                     */
                     // find which node we're in here, and record a link
-                    uint64_t next_id = seq_id_cbv_rank(offset(pos_start_in_s)+1);
+                    uint64_t next_id = seq_id_cbv.rank(offset(pos_start_in_s)+1);
                     //std::cerr << "id? " << next_id << std::endl;
                     bool next_step_is_rev = is_rev(pos_start_in_s);
                     //std::cerr << "link " << (curr_step_is_rev ? "-" : "+") << " " << (next_step_is_rev ? "-" : "+") << std::endl;
@@ -116,13 +120,77 @@ void derive_links(seqindex_t& seqidx,
                     std::cerr << "link " << pos_to_string(make_pos_t(id, curr_step_is_rev))
                               << " " << pos_to_string(make_pos_t(next_id, next_step_is_rev)) << std::endl;
                     */
-                    link_mmset.append(std::make_pair(make_pos_t(id, curr_step_is_rev), make_pos_t(next_id, next_step_is_rev)));
+                    node_links.push_back(std::make_pair(make_pos_t(id, curr_step_is_rev), make_pos_t(next_id, next_step_is_rev)));
                 }
             }
         }
         // and find their neighbors by looking in the path_iitree
         
         // decide and record which links these imply
+        std::sort(node_links.begin(), node_links.end());
+        node_links.erase(std::unique(node_links.begin(), node_links.end()), node_links.end());
+        for (auto& link : node_links) {
+            link_mmset.append(link);
+        }
+    }
+    }
+    link_mmset.index();
+}
+
+
+void derive_links_from_paths(seqindex_t& seqidx,
+                             mmmulti::iitree<uint64_t, pos_t>& path_iitree,
+                             const node_index_t& seq_id_cbv,
+                             mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset) {
+    // each link joins consecutive steps of some path, so we walk every path once, in parallel across paths
+    size_t num_seqs = seqidx.n_seqs();
+#pragma omp parallel
+    {
+    iitree_cursor_t<uint64_t, pos_t> path_cursor(path_iitree);
+    // paths through the same region repeat the same links, so we dedup them in a thread-local buffer
+    const size_t buffer_max = 1 << 20;
+    std::vector<std::pair<pos_t, pos_t>> links;
+    auto compact_links = [&](bool flush) {
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
+        // once deduplication stops paying, let the set handle what's left
+        if (flush || links.size() > buffer_max / 2) {
+            for (auto& link : links) {
+                link_mmset.append(link);
+            }
+            links.clear();
+        }
+    };
+#pragma omp for schedule(dynamic)
+    for (size_t i = 1; i <= num_seqs; ++i) {
+        // a collapsed duplicate takes the same steps as its representative
+        if (seqidx.duplicate_of(i)) continue;
+        size_t j = seqidx.nth_seq_offset(i);
+        size_t k = j + seqidx.nth_seq_length(i);
+        pos_t prev_step = 0;
+        while (j < k) {
+            path_cursor.seek(j);
+            uint64_t length = path_cursor.end() - path_cursor.start();
+            pos_t pos_start_in_s = path_cursor.data();
+            bool step_is_rev = is_rev(pos_start_in_s);
+            // the nodes covering this range, in the order the path steps through them
+            uint64_t first_id = seq_id_cbv.rank(offset(pos_start_in_s)+1);
+            uint64_t last_id = step_is_rev
+                ? seq_id_cbv.rank(offset(pos_start_in_s)+2-length)
+                : seq_id_cbv.rank(offset(pos_start_in_s)+length);
+            for (uint64_t id = first_id; ; step_is_rev ? --id : ++id) {
+                pos_t step = make_pos_t(id, step_is_rev);
+                if (prev_step) {
+                    links.push_back(std::make_pair(prev_step, step));
+                }
+                prev_step = step;
+                if (id == last_id) break;
+            }
+            j = path_cursor.end();
+        }
+        if (links.size() >= buffer_max) compact_links(false);
+    }
+    compact_links(true);
     }
     link_mmset.index();
 }
@@ -2,10 +2,13 @@
 #define LINKS_HPP_INCLUDED
 
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include "seqindex.hpp"
+#include "nodeindex.hpp"
 #include "mmmultiset.hpp"
 #include "mmiitree.hpp"
+#include "iitree_cursor.hpp"
 #include "pos.hpp"
 
 namespace seqwish {
@@ -14,11 +17,15 @@ namespace seqwish {
 void derive_links(seqindex_t& seqidx,
                   mmmulti::iitree<uint64_t, pos_t>& node_iitree,
                   mmmulti::iitree<uint64_t, pos_t>& path_iitree,
-                  const sdsl::sd_vector<>& seq_id_cbv,
-                  const sdsl::sd_vector<>::rank_1_type& seq_id_cbv_rank,
-                  const sdsl::sd_vector<>::select_1_type& seq_id_cbv_select,
+                  const node_index_t& seq_id_cbv,
                   mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset);
 
+// find the same links by walking the paths, which avoids the node_iitree queries
+void derive_links_from_paths(seqindex_t& seqidx,
+                             mmmulti::iitree<uint64_t, pos_t>& path_iitree,
+                             const node_index_t& seq_id_cbv,
+                             mmmulti::set<std::pair<pos_t, pos_t>>& link_mmset);
+
 }
 
 #endif
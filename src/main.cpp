@@ -9,9 +9,12 @@
 #include "seqindex.hpp"
 #include "paf.hpp"
 #include "alignments.hpp"
+#include "matchlist.hpp"
 #include "transclosure.hpp"
 #include "links.hpp"
 #include "compact.hpp"
+#include "nodeindex.hpp"
+#include "adjacency.hpp"
 #include "gfa.hpp"
 #include "vgp.hpp"
 #include "pos.hpp"
@@ -25,17 +28,29 @@ using namespace seqwish;
 int main(int argc, char** argv) {
     args::ArgumentParser parser("seqwish: a variation graph inducer");
     args::HelpFlag help(parser, "help", "display this help menu", {'h', "help"});
-    args::ValueFlag<std::string> paf_alns(parser, "FILE", "Induce the graph from these PAF formatted alignments. Optionally, a list of filenames and minimum match lengths: [file_1]:[min_match_length_1],... This allows the differential filtering of short matches from some but not all inputs, in effect allowing `-k` to be specified differently for each input.", {'p', "paf-alns"});
+    args::ValueFlag<std::string> paf_alns(parser, "FILE", "Induce the graph from these PAF formatted alignments (SXS files are detected and accepted as well). Optionally, a list of filenames and minimum match lengths: [file_1]:[min_match_length_1],... This allows the differential filtering of short matches from some but not all inputs, in effect allowing `-k` to be specified differently for each input.", {'p', "paf-alns"});
     args::ValueFlag<std::string> seqs(parser, "FILE", "The sequences used to generate the alignments (FASTA, FASTQ, .seq)", {'s', "seqs"});
+    args::Flag seqs_in_place(parser, "", "Read sequences directly from the uncompressed FASTA given with -s, using its .fai index if present, rather than copying them into the index (requires even line lengths within each record)", {'F', "fasta-in-place"});
     args::ValueFlag<std::string> base(parser, "BASE", "Build graph using this basename", {'b', "base"});
     args::ValueFlag<std::string> gfa_out(parser, "FILE", "Write the graph in GFA to FILE", {'g', "gfa"});
-    args::ValueFlag<std::string> sml_in(parser, "FILE", "Use the sequence match list in FILE to subset the input alignments", {'m', "match-list"});
+    args::ValueFlag<std::string> sml_in(parser, "FILE", "Use the sequence match list in FILE to subset the input alignments. Each line names a pair of sequences (whitespace separated, in either order), and only alignments between listed pairs are used.", {'m', "match-list"});
     args::ValueFlag<std::string> vgp_base(parser, "BASE", "Write the graph in VGP format with basename FILE", {'o', "vgp-out"});
     args::ValueFlag<uint64_t> num_threads(parser, "N", "Use this many threads during parallel steps", {'t', "threads"});
     args::ValueFlag<uint64_t> repeat_max(parser, "N", "Limit transitive closure to include no more than N copies of a given input base", {'r', "repeat-max"});
     args::ValueFlag<uint64_t> min_match_len(parser, "N", "Filter exact matches below this length. This can smooth the graph locally and prevent the formation of complex local graph topologies from forming due to differential alignments.", {'k', "min-match-len"});
+    args::ValueFlag<double> min_identity(parser, "FLOAT", "Ignore alignments whose identity (PAF matches / alignment block length) is below FLOAT", {'I', "min-identity"});
+    args::ValueFlag<uint64_t> min_block_len(parser, "N", "Ignore alignments with a block length below N", {'l', "min-block-len"});
+    args::ValueFlag<uint64_t> min_mapq(parser, "N", "Ignore alignments with a mapping quality below N (at most 255)", {'Q', "min-mapq"});
+    args::ValueFlag<uint64_t> max_per_query(parser, "N", "Keep only the N alignments with the most matches for each query sequence in each input file. This reads each PAF twice, parsing every record to rank them before any are unpacked.", {'n', "max-per-query"});
+    args::ValueFlag<uint64_t> keep_n_longest(parser, "N", "Before the closure, keep only the N longest exact matches overlapping each input base, which limits the closure's fan-out in repeats (default: keep all). It no longer takes a minimum match length, which is -k's job.", {'N', "keep-n-longest"});
+    args::Flag dedup_matches(parser, "", "Store each exact match once, collapsing those implied by both an alignment and its reciprocal, and report the fraction collapsed. This uses memory proportional to the number of exact matches.", {'u', "unique-matches"});
+    args::Flag collapse_dups(parser, "", "Close only the first copy of each sequence that is repeated exactly (in either orientation) in the input, moving alignments of the other copies onto it and writing their paths through its nodes", {'C', "collapse-duplicates"});
     args::ValueFlag<uint64_t> transclose_batch(parser, "N", "Number of bp to use for transitive closure batch (default 1M)", {'B', "transclose-batch"});
     //args::ValueFlag<uint64_t> num_domains(parser, "N", "number of domains for iitii interpolation", {'D', "domains"});
+    args::Flag keep_seq_index(parser, "", "Keep the sequence index (.sqq and .sqi) after graph induction. Later runs with the same base and unchanged sequences load it rather than rebuilding it.", {'K', "keep-seq-index"});
+    args::Flag links_from_paths(parser, "", "Derive links by walking each path once, in parallel across paths, rather than by querying the input ranges of each node", {'L', "links-from-paths"});
+    args::ValueFlag<std::string> path_lines(parser, "STYLE", "Write paths as P lines with a * overlap between each pair of steps (P, the default), as P lines with a single * for all their overlaps (P1), or as GFA 1.1 W lines (W)", {'P', "path-lines"});
+    args::Flag bench_node_index(parser, "", "Time access, rank and select queries on each node boundary index structure for this graph, reporting ns per query on stderr", {"bench-node-index"});
     args::Flag keep_temp_files(parser, "", "keep intermediate files generated during graph induction", {'T', "keep-temp"});
     args::Flag debug(parser, "debug", "enable debugging", {'d', "debug"});
     try {
@@ -60,11 +75,33 @@ int main(int argc, char** argv) {
         omp_set_num_threads(1);
     }
 
+    if (!args::get(sml_in).empty() && !file_exists(args::get(sml_in))) {
+        std::cerr << "[seqwish] ERROR: input match list " << args::get(sml_in) << " does not exist" << std::endl;
+        return 5;
+    }
+
     if (!args::get(seqs).empty() && !file_exists(args::get(seqs))) {
         std::cerr << "[seqwish] ERROR: input sequence file " << args::get(seqs) << " does not exist" << std::endl;
         return 2;
     }
 
+    gfa_path_style_t path_style = gfa_paths_overlaps;
+    if (!args::get(path_lines).empty()) {
+        if (args::get(path_lines) == "P1") {
+            path_style = gfa_paths_no_overlaps;
+        } else if (args::get(path_lines) == "W") {
+            path_style = gfa_walks;
+        } else if (args::get(path_lines) != "P") {
+            std::cerr << "[seqwish] ERROR: unknown path line style " << args::get(path_lines) << ", expected P, P1 or W" << std::endl;
+            return 1;
+        }
+    }
+
+    if (args::get(min_mapq) > 255) {
+        std::cerr << "[seqwish] ERROR: minimum mapping quality " << args::get(min_mapq) << " is above the PAF maximum of 255" << std::endl;
+        return 1;
+    }
+
     // parse paf args
     std::vector<std::pair<std::string, uint64_t>> pafs_and_min_lengths;
     if (!args::get(paf_alns).empty()) {
@@ -82,32 +119,68 @@ int main(int argc, char** argv) {
         work_base = args::get(gfa_out);
     }
 
-    // 1) index the queries (Q) to provide sequence name to position and position to sequence name mapping, generating a CSA and a sequence file
+    // 1) index the queries (Q) to provide sequence name to position and position to sequence name mapping, generating a name dictionary and a sequence file
     seqindex_t seqidx;
-    seqidx.build_index(args::get(seqs), work_base);
-    seqidx.save();
+    bool reused_seqidx = seqidx.load_if_current(args::get(seqs), work_base, args::get(seqs_in_place));
+    if (reused_seqidx) {
+        std::cerr << "[seqwish] reusing the sequence index at " << work_base << ".sqi" << std::endl;
+    } else if (args::get(seqs_in_place)) {
+        seqidx.build_index_from_faidx(args::get(seqs), work_base);
+    } else {
+        seqidx.build_index(args::get(seqs), work_base);
+    }
+    // the duplicate table is only built for -C, and saved with a fresh index
+    seqidx.collapse_duplicates(args::get(collapse_dups));
+    if (!reused_seqidx) {
+        seqidx.save();
+    }
+    if (seqidx.n_duplicates()) {
+        std::cerr << "[seqwish] collapsing " << seqidx.n_duplicates() << " duplicate sequences" << std::endl;
+    }
 
     // 2) parse the alignments into position pairs and index (A)
     std::string aln_idx = work_base + ".sqa";
     std::remove(aln_idx.c_str());
     mmmulti::iitree<uint64_t, pos_t> aln_iitree(aln_idx);
-    if (!pafs_and_min_lengths.empty()) {
-        for (auto& p : pafs_and_min_lengths) {
-            auto& file = p.first;
-            uint64_t min_length = p.second;
-            if (!min_length && args::get(min_match_len)) {
-                min_length = args::get(min_match_len);
-            }
-            unpack_paf_alignments(file, aln_iitree, seqidx, min_length);
+    match_list_t match_list;
+    if (!args::get(sml_in).empty()) {
+        match_list.load(args::get(sml_in), seqidx);
+        if (match_list.empty()) {
+            std::cerr << "[seqwish] ERROR: match list " << args::get(sml_in) << " names no pairs of input sequences" << std::endl;
+            return 5;
         }
     }
+    match_set_t match_set(args::get(dedup_matches));
+    paf_filter_t paf_filter;
+    paf_filter.min_identity = args::get(min_identity);
+    paf_filter.min_block_length = args::get(min_block_len);
+    paf_filter.min_mapping_quality = args::get(min_mapq);
+    paf_filter.max_per_query = args::get(max_per_query);
+    if (!pafs_and_min_lengths.empty()) {
+        unpack_alignments(pafs_and_min_lengths, aln_iitree, seqidx, match_list, match_set, paf_filter, args::get(min_match_len));
+    }
+    if (match_set.is_enabled()) {
+        uint64_t seen = match_set.seen();
+        uint64_t unique = match_set.unique();
+        std::cerr << "[seqwish] collapsed " << seen - unique << " of " << seen << " exact matches ("
+                  << (seen ? 100.0 * (seen - unique) / seen : 0.0) << "%) as reciprocal duplicates" << std::endl;
+        match_set.clear();
+    }
     aln_iitree.index();
+    // optionally reduce the matches to the longest ones at each position
+    std::string aln_filt_idx = work_base + ".sqf";
+    std::remove(aln_filt_idx.c_str());
+    mmmulti::iitree<uint64_t, pos_t> aln_filt_iitree(aln_filt_idx);
+    if (args::get(keep_n_longest)) {
+        filter_alignments(aln_iitree, aln_filt_iitree, args::get(keep_n_longest), seqidx);
+    }
+    auto& closure_aln_iitree = args::get(keep_n_longest) ? aln_filt_iitree : aln_iitree;
     //if (args::get(debug)) dump_paf_alignments(args::get(paf_alns));
     //uint64_t n_domains = std::max((uint64_t)1, (uint64_t)args::get(num_domains));
     //range_pos_iitii aln_iitree = aln_iitree_builder.build(n_domains);
 
     if (args::get(debug)) {
-        for (auto& interval : aln_iitree) {
+        for (auto& interval : closure_aln_iitree) {
             std::cerr << "aln_iitree " << interval.st << "-" << interval.en << " " << pos_to_string(interval.data) << std::endl;
         }
     }
@@ -121,9 +194,11 @@ int main(int argc, char** argv) {
     std::remove(path_iitree_idx.c_str());
     mmmulti::iitree<uint64_t, pos_t> node_iitree(node_iitree_idx); // maps graph seq to input seq
     mmmulti::iitree<uint64_t, pos_t> path_iitree(path_iitree_idx); // maps input seq to graph seq
-    size_t graph_length = compute_transitive_closures(seqidx, aln_iitree, seq_v_file, node_iitree, path_iitree,
+    sdsl::bit_vector seq_id_bv; // the closure marks node boundaries as it goes
+    size_t graph_length = compute_transitive_closures(seqidx, closure_aln_iitree, seq_v_file, node_iitree, path_iitree,
                                                       args::get(repeat_max),
-                                                      !args::get(transclose_batch) ? 1000000 : args::get(transclose_batch));
+                                                      !args::get(transclose_batch) ? 1000000 : args::get(transclose_batch),
+                                                      seq_id_bv);
 
     if (args::get(debug)) {
         for (auto& interval : node_iitree) {
@@ -134,38 +209,57 @@ int main(int argc, char** argv) {
         }
     }
 
-    // 4) generate the node id index (I) by compressing non-bifurcating regions of the graph into nodes
-    sdsl::bit_vector seq_id_bv(graph_length+1);
-    compact_nodes(seqidx, graph_length, node_iitree, path_iitree, seq_id_bv);
-    if (args::get(debug)) std::cerr << seq_id_bv << std::endl;
-    sdsl::sd_vector<> seq_id_cbv;
-    sdsl::sd_vector<>::rank_1_type seq_id_cbv_rank;
-    sdsl::sd_vector<>::select_1_type seq_id_cbv_select;
-    sdsl::util::assign(seq_id_cbv, sdsl::sd_vector<>(seq_id_bv));
-    seq_id_bv = sdsl::bit_vector(); // clear bitvector
-    sdsl::util::assign(seq_id_cbv_rank, sdsl::sd_vector<>::rank_1_type(&seq_id_cbv));
-    sdsl::util::assign(seq_id_cbv_select, sdsl::sd_vector<>::select_1_type(&seq_id_cbv));
+    // 4) generate the node id index (I) from the node boundaries the closure found in the graph sequence
+    if (args::get(debug)) {
+        std::cerr << seq_id_bv << std::endl;
+        // check them against a separate pass over the paths
+        sdsl::bit_vector compact_bv(graph_length+1);
+        compact_nodes(seqidx, graph_length, node_iitree, path_iitree, compact_bv);
+        for (size_t i = 0; i <= graph_length; ++i) {
+            if (compact_bv[i] != seq_id_bv[i]) {
+                std::cerr << "[seqwish] ERROR: node boundary at " << i << " differs from compaction" << std::endl;
+                return 1;
+            }
+        }
+    }
+    if (args::get(bench_node_index)) {
+        node_index_t::benchmark(seq_id_bv, std::cerr);
+    }
+    node_index_t seq_id_cbv;
+    seq_id_cbv.build(std::move(seq_id_bv)); // takes over or clears the bitvector
+    if (args::get(debug)) {
+        std::cerr << "[seqwish] node index is " << node_index_t::type_name(seq_id_cbv.type())
+                  << " (" << seq_id_cbv.bytes() << " bytes)" << std::endl;
+    }
 
     // 5) determine links between nodes
     std::string link_mm_idx = work_base + ".sql";
     std::remove(link_mm_idx.c_str());
     mmmulti::set<std::pair<pos_t, pos_t>> link_mmset(link_mm_idx);
-    derive_links(seqidx, node_iitree, path_iitree, seq_id_cbv, seq_id_cbv_rank, seq_id_cbv_select, link_mmset);
+    if (args::get(links_from_paths)) {
+        derive_links_from_paths(seqidx, path_iitree, seq_id_cbv, link_mmset);
+    } else {
+        derive_links(seqidx, node_iitree, path_iitree, seq_id_cbv, link_mmset);
+    }
+    // and index them in both directions for the writers
+    graph_adjacency_t adjacency;
+    adjacency.build(link_mmset, seq_id_cbv.rank(seq_id_cbv.size()-1));
     
     // 6) emit the graph in GFA or VGP format
     if (!args::get(gfa_out).empty()) {
         std::ofstream out(args::get(gfa_out).c_str());
-        emit_gfa(out, graph_length, seq_v_file, node_iitree, path_iitree, seq_id_cbv, seq_id_cbv_rank, seq_id_cbv_select, seqidx, link_mmset);
+        emit_gfa(out, graph_length, seq_v_file, node_iitree, path_iitree, seq_id_cbv, seqidx, adjacency, path_style);
     } else if (!args::get(vgp_base).empty()) {
         assert(false);
         //emit_vgp(args::get(vgp_base), graph_length, seq_v_file, path_mm, link_fwd_mm, link_rev_mm, seq_id_cbv, seq_id_cbv_rank, seq_id_cbv_select, seqidx);
     } else {
-        emit_gfa(std::cout, graph_length, seq_v_file, node_iitree, path_iitree, seq_id_cbv, seq_id_cbv_rank, seq_id_cbv_select, seqidx, link_mmset);
+        emit_gfa(std::cout, graph_length, seq_v_file, node_iitree, path_iitree, seq_id_cbv, seqidx, adjacency, path_style);
     }
 
     if (!args::get(keep_temp_files)) {
-        seqidx.remove_index_files();
+        if (!args::get(keep_seq_index)) seqidx.remove_index_files();
         std::remove(aln_idx.c_str());
+        std::remove(aln_filt_idx.c_str());
         std::remove(seq_v_file.c_str());
         std::remove(node_iitree_idx.c_str());
         std::remove(path_iitree_idx.c_str());
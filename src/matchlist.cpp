@@ -0,0 +1,79 @@
+#include "matchlist.hpp"
+#include "tokenize.hpp"
+
+namespace seqwish {
+
+uint64_t match_list_t::pack(uint64_t a, uint64_t b) {
+    // the pairs are unordered, so we always put the smaller rank in the top bits
+    if (a > b) std::swap(a, b);
+    return a << 32 | b;
+}
+
+uint64_t match_list_t::hash(uint64_t key) {
+    // murmur3 finalizer
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+void match_list_t::insert(uint64_t key) {
+    uint64_t i = hash(key) & mask;
+    while (table[i] != 0) {
+        if (table[i] == key) return;
+        i = (i + 1) & mask;
+    }
+    table[i] = key;
+    ++n_pairs;
+}
+
+void match_list_t::load(const std::string& filename, const seqindex_t& seqidx) {
+    assert(seqidx.n_seqs() < ((uint64_t)1 << 32));
+    std::vector<uint64_t> keys;
+    ipgzstream in(filename.c_str());
+    std::string line;
+    uint64_t skipped = 0;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::vector<std::string> fields;
+        tokenize(line, fields, " \t", true);
+        if (fields.size() < 2) continue;
+        if (!seqidx.has_seq_named(fields[0]) || !seqidx.has_seq_named(fields[1])) {
+            ++skipped;
+            continue;
+        }
+        keys.push_back(pack(seqidx.rank_of_seq_named(fields[0]),
+                            seqidx.rank_of_seq_named(fields[1])));
+    }
+    if (in.bad()) exit(1); // the stream has said what was wrong with the input
+    in.close();
+    if (skipped) {
+        std::cerr << "[seqwish] WARNING: skipped " << skipped << " pairs in match list "
+                  << filename << " naming sequences not in the input" << std::endl;
+    }
+    // size the table to a power of two at most half full
+    uint64_t table_size = 2;
+    while (table_size < 2 * keys.size()) table_size <<= 1;
+    table.assign(table_size, 0);
+    mask = table_size - 1;
+    n_pairs = 0;
+    is_loaded = true;
+    for (auto& key : keys) {
+        insert(key);
+    }
+}
+
+bool match_list_t::contains(uint64_t rank_a, uint64_t rank_b) const {
+    if (table.empty()) return false;
+    uint64_t key = pack(rank_a, rank_b);
+    uint64_t i = hash(key) & mask;
+    while (table[i] != 0) {
+        if (table[i] == key) return true;
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+}
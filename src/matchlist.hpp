@@ -0,0 +1,45 @@
+#ifndef MATCHLIST_HPP_INCLUDED
+#define MATCHLIST_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "seqindex.hpp"
+#include "pgzstream.hpp"
+
+namespace seqwish {
+
+// a set of unordered sequence pairs, keyed by sequence rank in the seqindex_t
+// used to subset the input alignments to those between the listed pairs
+// the table is open addressed and read-only after loading, so lookups are safe from any thread
+class match_list_t {
+
+private:
+
+    std::vector<uint64_t> table; // ranks are 1-based, so no pair packs to 0 and 0 marks an empty slot
+    uint64_t mask = 0;
+    size_t n_pairs = 0;
+    // whether a list was given at all, as a loaded list with no usable pairs matches nothing
+    bool is_loaded = false;
+    static uint64_t pack(uint64_t a, uint64_t b);
+    static uint64_t hash(uint64_t key);
+    void insert(uint64_t key);
+
+public:
+
+    match_list_t(void) { }
+    // read whitespace-separated pairs of sequence names, one pair per line
+    void load(const std::string& filename, const seqindex_t& seqidx);
+    bool loaded(void) const { return is_loaded; }
+    bool empty(void) const { return n_pairs == 0; }
+    size_t size(void) const { return n_pairs; }
+    bool contains(uint64_t rank_a, uint64_t rank_b) const;
+    // whether alignments between these sequences pass the list, which they all do when none was loaded
+    bool keep(uint64_t rank_a, uint64_t rank_b) const { return !is_loaded || contains(rank_a, rank_b); }
+
+};
+
+}
+
+#endif
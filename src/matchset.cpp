@@ -0,0 +1,47 @@
+#include "matchset.hpp"
+
+namespace seqwish {
+
+size_t match_set_t::key_hash_t::operator()(const key_t& k) const {
+    // mix the three words with the murmur3 finalizer
+    uint64_t h = k.a * 0x9e3779b97f4a7c15ULL ^ k.b;
+    h = h * 0x9e3779b97f4a7c15ULL ^ k.len;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+match_set_t::match_set_t(bool enable)
+    : enabled(enable), n_seen(0), n_unique(0) {
+    if (enabled) {
+        shards.resize((size_t)n_shards);
+        locks = std::vector<SpinLock>((size_t)n_shards);
+    }
+}
+
+bool match_set_t::insert(uint64_t q_start, uint64_t t_start, uint64_t len, bool is_rev) {
+    if (!enabled) return true;
+    key_t key = { std::min(q_start, t_start),
+                  std::max(q_start, t_start),
+                  len | ((uint64_t)is_rev << 63) };
+    size_t h = key_hash_t()(key);
+    // use the high bits to pick our shard, as the set itself uses the low bits
+    uint64_t i = (h >> 54) % n_shards;
+    bool inserted;
+    locks[i].lock();
+    inserted = shards[i].insert(key).second;
+    locks[i].unlock();
+    ++n_seen;
+    if (inserted) ++n_unique;
+    return inserted;
+}
+
+void match_set_t::clear(void) {
+    shards.clear();
+    shards.shrink_to_fit();
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef MATCHSET_HPP_INCLUDED
+#define MATCHSET_HPP_INCLUDED
+
+#include <vector>
+#include <unordered_set>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include "spinlock.hpp"
+
+namespace seqwish {
+
+// a concurrent set of exact matches in canonical form
+// a match between two ranges of length len in Q is the same match whichever of its ranges is the query,
+// so we key it on (lower range start, higher range start, length, orientation)
+// this lets us store matches implied by both an alignment and its reciprocal only once
+class match_set_t {
+
+private:
+
+    struct key_t {
+        uint64_t a;
+        uint64_t b;
+        uint64_t len; // top bit holds the relative orientation
+        bool operator==(const key_t& o) const { return a == o.a && b == o.b && len == o.len; }
+    };
+    struct key_hash_t {
+        size_t operator()(const key_t& k) const;
+    };
+    static const uint64_t n_shards = 1024;
+    bool enabled = false;
+    std::vector<std::unordered_set<key_t, key_hash_t>> shards;
+    std::vector<SpinLock> locks;
+    std::atomic<uint64_t> n_seen;
+    std::atomic<uint64_t> n_unique;
+
+public:
+
+    match_set_t(bool enable);
+    // returns true if the match has not been inserted before (or if we are disabled)
+    bool insert(uint64_t q_start, uint64_t t_start, uint64_t len, bool is_rev);
+    bool is_enabled(void) const { return enabled; }
+    uint64_t seen(void) const { return n_seen.load(); }
+    uint64_t unique(void) const { return n_unique.load(); }
+    // free the set once ingestion is complete
+    void clear(void);
+
+};
+
+}
+
+#endif
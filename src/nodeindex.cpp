@@ -0,0 +1,99 @@
+#include "nodeindex.hpp"
+#include <chrono>
+#include <random>
+#include <functional>
+#include <vector>
+#include <cmath>
+
+namespace seqwish {
+
+node_index_t::kind_t node_index_t::choose(uint64_t length, uint64_t n_bounds) {
+    // a plain bitvector costs a bit per base, plus a quarter for rank and a bit under that for select,
+    // while an sd_vector costs 2 + log(length / n_bounds) bits per boundary
+    double plain_bytes = length * 1.45 / 8;
+    double sparse_bytes = n_bounds * (2 + std::log2((double)length / std::max(n_bounds, (uint64_t)1))) / 8;
+    // plain is several times faster to query, so we take it unless it's large and much bigger than sparse
+    return plain_bytes < plain_min_bytes || plain_bytes <= 2 * sparse_bytes ? plain : sparse;
+}
+
+void node_index_t::build(sdsl::bit_vector&& bounds) {
+    uint64_t n_bounds = 0;
+    const uint64_t* words = bounds.data();
+    for (uint64_t i = 0; i < (bounds.size() + 63) / 64; ++i) {
+        n_bounds += __builtin_popcountll(words[i]);
+    }
+    kind_t k = choose(bounds.size(), n_bounds);
+    build(std::move(bounds), k);
+}
+
+void node_index_t::build(sdsl::bit_vector&& bounds, kind_t k) {
+    kind = k;
+    if (kind == plain) {
+        sd = sdsl::sd_vector<>();
+        bv = std::move(bounds);
+        sdsl::util::assign(bv_rank, sdsl::bit_vector::rank_1_type(&bv));
+        sdsl::util::assign(bv_select, sdsl::bit_vector::select_1_type(&bv));
+    } else {
+        bv = sdsl::bit_vector();
+        sdsl::util::assign(sd, sdsl::sd_vector<>(bounds));
+        bounds = sdsl::bit_vector();
+        sdsl::util::assign(sd_rank, sdsl::sd_vector<>::rank_1_type(&sd));
+        sdsl::util::assign(sd_select, sdsl::sd_vector<>::select_1_type(&sd));
+    }
+}
+
+uint64_t node_index_t::bytes(void) const {
+    if (kind == plain) {
+        return sdsl::size_in_bytes(bv) + sdsl::size_in_bytes(bv_rank) + sdsl::size_in_bytes(bv_select);
+    } else {
+        return sdsl::size_in_bytes(sd) + sdsl::size_in_bytes(sd_rank) + sdsl::size_in_bytes(sd_select);
+    }
+}
+
+void node_index_t::benchmark(const sdsl::bit_vector& bounds, std::ostream& out, uint64_t n_queries) {
+    if (bounds.size() < 2) return;
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> positions(n_queries);
+    for (auto& p : positions) p = rng() % (bounds.size() - 1);
+    uint64_t n_bounds = 0;
+    for (uint64_t i = 0; i < bounds.size(); ++i) n_bounds += bounds[i];
+    if (n_bounds < 2) return;
+    std::vector<uint64_t> ids(n_queries);
+    for (auto& id : ids) id = 1 + rng() % (n_bounds - 1);
+    out << "[seqwish] node index benchmark: " << bounds.size() << " bp, " << n_bounds << " boundaries, "
+        << n_queries << " queries, automatic choice " << type_name(choose(bounds.size(), n_bounds)) << std::endl;
+    for (auto k : { plain, sparse }) {
+        node_index_t index;
+        auto build_start = std::chrono::steady_clock::now();
+        index.build(sdsl::bit_vector(bounds), k);
+        auto build_end = std::chrono::steady_clock::now();
+        // the sum keeps the queries from being optimized away
+        uint64_t sum = 0;
+        auto time_ns = [&](const std::function<void(void)>& queries, uint64_t count) {
+            auto start = std::chrono::steady_clock::now();
+            queries();
+            auto end = std::chrono::steady_clock::now();
+            return std::chrono::duration<double, std::nano>(end - start).count() / count;
+        };
+        double access_ns = time_ns([&](void) { for (auto p : positions) sum += index[p]; }, n_queries);
+        double rank_ns = time_ns([&](void) { for (auto p : positions) sum += index.rank(p + 1); }, n_queries);
+        double select_ns = time_ns([&](void) { for (auto id : ids) sum += index.select(id); }, n_queries);
+        // a path walk tests every base and ranks those that start nodes, as emit_gfa does
+        uint64_t walk_length = std::min(n_queries, (uint64_t)bounds.size() - 1);
+        double walk_ns = time_ns([&](void) {
+                for (uint64_t p = 0; p < walk_length; ++p) {
+                    if (index[p]) sum += index.rank(p + 1);
+                }
+            }, walk_length);
+        out << "[seqwish] node index " << type_name(k) << ": "
+            << index.bytes() << " bytes, "
+            << std::chrono::duration<double, std::milli>(build_end - build_start).count() << " ms to build, "
+            << access_ns << " ns/access, "
+            << rank_ns << " ns/rank, "
+            << select_ns << " ns/select, "
+            << walk_ns << " ns/base on a path walk"
+            << " (checksum " << sum << ")" << std::endl;
+    }
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef NODEINDEX_HPP_INCLUDED
+#define NODEINDEX_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include "sdsl/bit_vectors.hpp"
+
+namespace seqwish {
+
+// the node boundaries in the graph sequence S, answering where each node starts (select)
+// and which node a position in S falls in (rank)
+// link derivation and path emission query it for every node and path base, so we keep the boundaries
+// in a plain bitvector with rank and select support when that fits, and in an sd_vector when S is too
+// long and sparse for a bit per base to be worth it
+class node_index_t {
+
+public:
+
+    enum kind_t { sparse, plain };
+
+private:
+
+    kind_t kind = sparse;
+    sdsl::sd_vector<> sd;
+    sdsl::sd_vector<>::rank_1_type sd_rank;
+    sdsl::sd_vector<>::select_1_type sd_select;
+    sdsl::bit_vector bv;
+    sdsl::bit_vector::rank_1_type bv_rank;
+    sdsl::bit_vector::select_1_type bv_select;
+    // plain bitvectors below this size are always used
+    static const uint64_t plain_min_bytes = 64 << 20;
+
+public:
+
+    node_index_t(void) { }
+    // the supports point into this object, so it can't be copied
+    node_index_t(const node_index_t&) = delete;
+    node_index_t& operator=(const node_index_t&) = delete;
+    // pick a structure from the length of S and its count of boundaries
+    static kind_t choose(uint64_t length, uint64_t n_bounds);
+    // take over the boundaries, using the structure chosen for them
+    void build(sdsl::bit_vector&& bounds);
+    void build(sdsl::bit_vector&& bounds, kind_t k);
+    kind_t type(void) const { return kind; }
+    static std::string type_name(kind_t k) { return k == plain ? "plain" : "sparse"; }
+    uint64_t bytes(void) const;
+    uint64_t size(void) const {
+        return kind == plain ? bv.size() : sd.size();
+    }
+    bool operator[](uint64_t i) const {
+        return kind == plain ? bv[i] : sd[i];
+    }
+    // the number of boundaries before position i
+    uint64_t rank(uint64_t i) const {
+        return kind == plain ? bv_rank(i) : sd_rank(i);
+    }
+    // the position of the kth boundary, 1-based
+    uint64_t select(uint64_t k) const {
+        return kind == plain ? bv_select(k) : sd_select(k);
+    }
+    // time access, rank and select on each structure over these boundaries, writing a table of ns per query
+    static void benchmark(const sdsl::bit_vector& bounds, std::ostream& out, uint64_t n_queries = 1000000);
+
+};
+
+}
+
+#endif
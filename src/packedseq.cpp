@@ -0,0 +1,222 @@
+#include "packedseq.hpp"
+#include "dna.hpp"
+#include <cassert>
+
+namespace seqwish {
+
+namespace {
+
+// 2-bit codes of ACGT in either case, 4 for everything else
+struct base_codes_t {
+    uint8_t code[256];
+    base_codes_t(void) {
+        std::memset(code, 4, sizeof(code));
+        code['A'] = code['a'] = 0;
+        code['C'] = code['c'] = 1;
+        code['G'] = code['g'] = 2;
+        code['T'] = code['t'] = 3;
+    }
+};
+
+// each packed byte holds 4 bases, so one lookup decodes 4 bases forward or reverse complemented
+struct byte_decoder_t {
+    char fwd[256][4];
+    char rev_comp[256][4];
+    byte_decoder_t(void) {
+        const char* bases = "ACGT";
+        for (uint64_t b = 0; b < 256; ++b) {
+            for (uint64_t i = 0; i < 4; ++i) {
+                uint8_t c = b >> (i << 1) & 3;
+                fwd[b][i] = bases[c];
+                rev_comp[b][3 - i] = bases[3 - c];
+            }
+        }
+    }
+};
+
+const base_codes_t base_codes;
+const byte_decoder_t byte_decoder;
+
+// the run covering pos, if any
+const packed_seq_run_t* find_run(const packed_seq_run_t* runs, uint64_t n, uint64_t pos) {
+    auto it = std::upper_bound(runs, runs + n, pos,
+                               [](uint64_t p, const packed_seq_run_t& r) { return p < r.begin(); });
+    if (it == runs) return nullptr;
+    --it;
+    return pos < it->end() ? it : nullptr;
+}
+
+}
+
+packed_seq_writer_t::packed_seq_writer_t(const std::string& filename) {
+    out.open(filename.c_str(), std::ios::binary);
+    // the header is rewritten with the final counts on close
+    uint64_t header[6] = { 0, 0, 0, 0, 0, 0 };
+    out.write((char*)header, sizeof(header));
+    words.reserve(1 << 16);
+}
+
+void packed_seq_writer_t::flag(uint64_t pos) {
+    uint64_t i = pos >> 12;
+    if (i >= flags.size()) flags.resize(i + 1, 0);
+    flags[i] |= (uint64_t)1 << ((pos >> 6) & 63);
+}
+
+void packed_seq_writer_t::flush_words(void) {
+    out.write((char*)words.data(), words.size() * sizeof(uint64_t));
+    n_words += words.size();
+    words.clear();
+}
+
+void packed_seq_writer_t::extend(std::vector<packed_seq_run_t>& runs, uint8_t base) {
+    if (!runs.empty()
+        && runs.back().end() == length
+        && runs.back().base() == (char)base
+        && runs.back().length() < 0xffff) {
+        runs.back().v += 1 << 8;
+    } else {
+        runs.push_back(packed_seq_run_t::make(length, 1, base));
+    }
+    flag(length);
+}
+
+void packed_seq_writer_t::append(const char* begin, const char* end) {
+    assert(length + (end - begin) < (uint64_t)1 << 40);
+    for (const char* p = begin; p != end; ++p, ++length) {
+        uint8_t c = *p;
+        uint64_t code = base_codes.code[c];
+        if (c >= 'a' && c <= 'z') {
+            extend(lower, 0);
+            c -= 'a' - 'A';
+        }
+        if (code > 3) {
+            extend(exceptions, c);
+            code = 0;
+        }
+        word |= code << ((length & 31) << 1);
+        if ((length & 31) == 31) {
+            words.push_back(word);
+            word = 0;
+            if (words.size() == words.capacity()) flush_words();
+        }
+    }
+}
+
+void packed_seq_writer_t::close(void) {
+    if (!out.is_open()) return;
+    if (length & 31) words.push_back(word);
+    flush_words();
+    flags.resize((length + 4095) >> 12, 0);
+    out.write((char*)flags.data(), flags.size() * sizeof(uint64_t));
+    out.write((char*)exceptions.data(), exceptions.size() * sizeof(packed_seq_run_t));
+    out.write((char*)lower.data(), lower.size() * sizeof(packed_seq_run_t));
+    uint64_t header[6] = { packed_seq_t::magic, length, n_words, flags.size(), exceptions.size(), lower.size() };
+    out.seekp(0);
+    out.write((char*)header, sizeof(header));
+    out.close();
+}
+
+bool packed_seq_t::attach(const char* buf, size_t size) {
+    const uint64_t* header = (const uint64_t*)buf;
+    // the writer puts in the magic last, so a file it didn't finish doesn't have it
+    if (size < 6 * sizeof(uint64_t) || header[0] != magic) return false;
+    length = header[1];
+    uint64_t n_words = header[2];
+    n_flag_words = header[3];
+    n_exceptions = header[4];
+    n_lower = header[5];
+    // check each count against what's left of the file, so that damaged counts can't overflow
+    uint64_t avail = size / sizeof(uint64_t) - 6;
+    if (n_words > avail || n_flag_words > avail - n_words) return false;
+    avail -= n_words + n_flag_words;
+    uint64_t avail_runs = avail * sizeof(uint64_t) / sizeof(packed_seq_run_t);
+    if (n_exceptions > avail_runs || n_lower > avail_runs - n_exceptions) return false;
+    if (n_words < (length + 31) / 32 || n_flag_words < (length + 4095) / 4096) return false;
+    words = header + 6;
+    flags = words + n_words;
+    exceptions = (const packed_seq_run_t*)(flags + n_flag_words);
+    lower = exceptions + n_exceptions;
+    return true;
+}
+
+char packed_seq_t::slow_at(size_t pos) const {
+    char c = "ACGT"[code_at(pos)];
+    auto e = find_run(exceptions, n_exceptions, pos);
+    if (e) c = e->base();
+    if (find_run(lower, n_lower, pos)) c += 'a' - 'A';
+    return c;
+}
+
+bool packed_seq_t::clean(size_t pos, size_t count) const {
+    if (!n_exceptions && !n_lower) return true;
+    for (size_t b = pos >> 6; count && b <= (pos + count - 1) >> 6; ++b) {
+        if (flags[b >> 6] >> (b & 63) & 1) return false;
+    }
+    return true;
+}
+
+void packed_seq_t::patch(size_t pos, size_t count, char* out) const {
+    size_t end = pos + count;
+    auto overlay = [&](const packed_seq_run_t* runs, uint64_t n, bool is_lower) {
+        auto it = std::upper_bound(runs, runs + n, pos,
+                                   [](uint64_t p, const packed_seq_run_t& r) { return p < r.begin(); });
+        if (it != runs) --it;
+        for ( ; it != runs + n && it->begin() < end; ++it) {
+            for (size_t i = std::max(pos, (size_t)it->begin()); i < std::min(end, (size_t)it->end()); ++i) {
+                if (is_lower) {
+                    out[i - pos] += 'a' - 'A';
+                } else {
+                    out[i - pos] = it->base();
+                }
+            }
+        }
+    };
+    // exceptions are stored uppercase, so they go first
+    overlay(exceptions, n_exceptions, false);
+    overlay(lower, n_lower, true);
+}
+
+void packed_seq_t::decode(size_t pos, size_t count, char* out) const {
+    size_t i = 0;
+    // bases up to the first whole packed byte
+    for ( ; i < count && ((pos + i) & 3); ++i) {
+        out[i] = "ACGT"[code_at(pos + i)];
+    }
+    for ( ; i + 4 <= count; i += 4) {
+        size_t k = pos + i;
+        uint8_t b = words[k >> 5] >> ((k & 31) << 1);
+        std::memcpy(out + i, byte_decoder.fwd[b], 4);
+    }
+    for ( ; i < count; ++i) {
+        out[i] = "ACGT"[code_at(pos + i)];
+    }
+    if (!clean(pos, count)) patch(pos, count, out);
+}
+
+void packed_seq_t::decode_rev_comp(size_t pos, size_t count, char* out) const {
+    if (!clean(pos, count)) {
+        // exceptions carry their own complements, so take the general route
+        decode(pos, count, out);
+        std::reverse(out, out + count);
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = dna_reverse_complement(out[i]);
+        }
+        return;
+    }
+    // walk backwards from the end of the range, complementing 2-bit codes as 3 - code
+    size_t end = pos + count;
+    size_t i = 0;
+    for ( ; i < count && ((end - i) & 3); ++i) {
+        out[i] = "TGCA"[code_at(end - i - 1)];
+    }
+    for ( ; i + 4 <= count; i += 4) {
+        size_t k = end - i - 4;
+        uint8_t b = words[k >> 5] >> ((k & 31) << 1);
+        std::memcpy(out + i, byte_decoder.rev_comp[b], 4);
+    }
+    for ( ; i < count; ++i) {
+        out[i] = "TGCA"[code_at(end - i - 1)];
+    }
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef PACKEDSEQ_HPP_INCLUDED
+#define PACKEDSEQ_HPP_INCLUDED
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace seqwish {
+
+// concatenated input sequence stored at 2 bits per base
+// anything that isn't ACGT (N, IUPAC codes, gaps) is kept in a sorted list of single-character runs,
+// and soft-masked (lowercase) sequence in a sorted list of lowercase runs
+// a bit per 64bp block marks where either list applies, so clean sequence never searches them
+//
+// the file is written once and mapped read-only; all fields are uint64_t:
+//   header: magic, length, n_words, n_flag_words, n_exceptions, n_lower
+//   words[n_words]: 32 bases per word, base i at bits 2*(i%32) of word i/32
+//   flags[n_flag_words]: one bit per 64bp block touched by an exception or lowercase run
+//   exceptions[n_exceptions]: runs of one base
+//   lower[n_lower]: runs of lowercase sequence
+
+// a run packed into one word: 40 bits of start, 16 of length and 8 for the base
+struct packed_seq_run_t {
+    uint64_t v;
+    static packed_seq_run_t make(uint64_t begin, uint64_t length, uint8_t base) {
+        return { begin << 24 | length << 8 | base };
+    }
+    uint64_t begin(void) const { return v >> 24; }
+    uint64_t length(void) const { return v >> 8 & 0xffff; }
+    uint64_t end(void) const { return begin() + length(); }
+    char base(void) const { return v & 0xff; }
+};
+
+class packed_seq_writer_t {
+
+private:
+
+    std::ofstream out;
+    std::vector<uint64_t> words;
+    uint64_t word = 0;
+    uint64_t length = 0;
+    uint64_t n_words = 0;
+    std::vector<uint64_t> flags;
+    std::vector<packed_seq_run_t> exceptions;
+    std::vector<packed_seq_run_t> lower;
+    void flag(uint64_t pos);
+    void extend(std::vector<packed_seq_run_t>& runs, uint8_t base);
+    void flush_words(void);
+
+public:
+
+    packed_seq_writer_t(const std::string& filename);
+    ~packed_seq_writer_t(void) { close(); }
+    void append(const char* begin, const char* end);
+    void close(void);
+    uint64_t size(void) const { return length; }
+
+};
+
+class packed_seq_t {
+
+private:
+
+    const uint64_t* words = nullptr;
+    const uint64_t* flags = nullptr;
+    const packed_seq_run_t* exceptions = nullptr;
+    const packed_seq_run_t* lower = nullptr;
+    uint64_t length = 0;
+    uint64_t n_flag_words = 0;
+    uint64_t n_exceptions = 0;
+    uint64_t n_lower = 0;
+    uint8_t code_at(size_t pos) const {
+        return words[pos >> 5] >> ((pos & 31) << 1) & 3;
+    }
+    bool flagged(size_t pos) const {
+        return flags[pos >> 12] >> ((pos >> 6) & 63) & 1;
+    }
+    bool clean(size_t pos, size_t count) const;
+    char slow_at(size_t pos) const;
+    void patch(size_t pos, size_t count, char* out) const;
+
+public:
+
+    static const uint64_t magic = 0x3271717368697773ULL; // "swihsqq2"
+    // attach to a mapped file written by packed_seq_writer_t, false if it's incomplete or not one of ours
+    bool attach(const char* buf, size_t size);
+    uint64_t size(void) const { return length; }
+    char at(size_t pos) const {
+        return flagged(pos) ? slow_at(pos) : "ACGT"[code_at(pos)];
+    }
+    // write the count bases starting at pos to out
+    void decode(size_t pos, size_t count, char* out) const;
+    // write the reverse complement of the count bases starting at pos to out
+    void decode_rev_comp(size_t pos, size_t count, char* out) const;
+
+};
+
+}
+
+#endif
@@ -3,31 +3,52 @@
 
 namespace seqwish {
 
-paf_row_t::paf_row_t(const std::string& line) {
+paf_row_t::paf_row_t(const std::string& line, bool with_cigar) {
+    // only split out the 12 mandatory columns, leaving the tags for parse_cigar
     std::vector<std::string> fields;
-    tokenize(line, fields, " \t");
+    fields.reserve(12);
+    std::string::size_type pos, last_pos = 0;
+    while (fields.size() < 12 && last_pos <= line.size()) {
+        pos = line.find_first_of(" \t", last_pos);
+        if (pos == std::string::npos) pos = line.size();
+        fields.push_back(line.substr(last_pos, pos - last_pos));
+        last_pos = pos + 1;
+    }
+    // a short or garbled record stays invalid, for the reader to report
+    if (fields.size() < 12) return;
     query_sequence_name = fields[0];
-    query_sequence_length = std::stol(fields[1]);
-    query_start = std::stol(fields[2]);
-    query_end = std::stol(fields[3]);
     query_target_same_strand = (fields[4] == "+");
     target_sequence_name = fields[5];
-    target_sequence_length = std::stol(fields[6]);
-    target_start = std::stol(fields[7]);
-    target_end = std::stol(fields[8]);
-    num_matches = std::stol(fields[9]);
-    alignment_block_length = std::stol(fields[10]);
-    mapping_quality = std::stoi(fields[11]);
-    // find the cigar in the last fields
-    for (size_t i = 12; i < fields.size(); ++i) {
-        // cg:Z:
-        auto& f = fields[i];
-        //std::string::size_type n;
-        auto n = f.find("cg:Z:");
-        if (n == 0) {
-            cigar = cigar_from_string(f.substr(5));
-            break;
-        }
+    uint64_t mapq;
+    if (!parse_uint(fields[1], query_sequence_length)
+        || !parse_uint(fields[2], query_start)
+        || !parse_uint(fields[3], query_end)
+        || !parse_uint(fields[6], target_sequence_length)
+        || !parse_uint(fields[7], target_start)
+        || !parse_uint(fields[8], target_end)
+        || !parse_uint(fields[9], num_matches)
+        || !parse_uint(fields[10], alignment_block_length)
+        || !parse_uint(fields[11], mapq)
+        || mapq > 255) {
+        return;
+    }
+    mapping_quality = mapq;
+    valid = true;
+    if (with_cigar) {
+        parse_cigar(line);
+    }
+}
+
+void paf_row_t::parse_cigar(const std::string& line) {
+    // find the cigar in the optional fields
+    // cg:Z:
+    auto n = line.find("cg:Z:");
+    while (n != std::string::npos && n > 0 && line[n-1] != '\t' && line[n-1] != ' ') {
+        n = line.find("cg:Z:", n + 1);
+    }
+    if (n != std::string::npos) {
+        auto e = line.find_first_of(" \t", n);
+        cigar = cigar_from_string(line.substr(n + 5, e == std::string::npos ? std::string::npos : e - n - 5));
     }
 }
 
@@ -48,11 +69,24 @@ std::ostream& operator<<(std::ostream& out, const paf_row_t& pafrow) {
     return out;
 }
 
+bool paf_filter_t::keep(const paf_row_t& paf) const {
+    return keep(paf.num_matches, paf.alignment_block_length, paf.mapping_quality);
+}
+
+bool paf_filter_t::keep(uint64_t num_matches, uint64_t alignment_block_length, uint16_t mapping_quality) const {
+    return alignment_block_length >= min_block_length
+        && mapping_quality >= min_mapping_quality
+        && (!min_identity
+            || (alignment_block_length
+                && (double)num_matches / (double)alignment_block_length >= min_identity));
+}
+
 void dump_paf_alignments(const std::string& filename) {
     std::ifstream in(filename.c_str());
     std::string line;
     while (std::getline(in, line)) {
         paf_row_t pafrow(line);
+        if (!pafrow.good()) continue;
         std::cout << pafrow << std::endl;
     }
 }
@@ -24,10 +24,24 @@ public:
     uint64_t alignment_block_length;
     uint16_t mapping_quality;
     cigar_t cigar;
-    paf_row_t(const std::string& l);
+    bool valid = false;
+    paf_row_t(const std::string& l, bool with_cigar = true);
+    // whether the line held the 12 mandatory columns, with numbers where they belong
+    bool good(void) const { return valid; }
+    void parse_cigar(const std::string& l);
     friend std::ostream& operator<<(std::ostream& out, const paf_row_t& pafrow);
 };
 
+// record level filters which only need the 12 mandatory PAF columns
+struct paf_filter_t {
+    double min_identity = 0; // num_matches / alignment_block_length
+    uint64_t min_block_length = 0;
+    uint16_t min_mapping_quality = 0;
+    uint64_t max_per_query = 0; // keep only the N records with the most matches per query, 0 for all
+    bool keep(const paf_row_t& paf) const;
+    bool keep(uint64_t num_matches, uint64_t alignment_block_length, uint16_t mapping_quality) const;
+};
+
 void dump_paf_alignments(const std::string& filename);
 
 std::vector<std::pair<std::string, uint64_t>> parse_paf_spec(const std::string& spec);
@@ -0,0 +1,313 @@
+#include "pgzstream.hpp"
+
+namespace seqwish {
+
+bool pgzstreambuf::open(const std::string& filename) {
+    close();
+    file = fopen(filename.c_str(), "rb");
+    if (!file) return false;
+    this->filename = filename;
+    n_threads = get_thread_count();
+    detect_format();
+    queue.clear();
+    queued_bytes = 0;
+    current.clear();
+    setg(nullptr, nullptr, nullptr);
+    producer_done = false;
+    stopping = false;
+    failed = false;
+    producer = std::thread(&pgzstreambuf::produce, this);
+    return true;
+}
+
+void pgzstreambuf::close(void) {
+    {
+        std::lock_guard<std::mutex> guard(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if (producer.joinable()) {
+        producer.join();
+    }
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+    queue.clear();
+    queued_bytes = 0;
+    current.clear();
+    setg(nullptr, nullptr, nullptr);
+}
+
+void pgzstreambuf::fail(const std::string& reason) {
+    std::lock_guard<std::mutex> guard(queue_mutex);
+    // a reader that has closed the stream doesn't care what was left in it
+    if (stopping) return;
+    if (!failed) {
+        std::cerr << "[seqwish] ERROR: " << reason << " in " << filename << std::endl;
+    }
+    failed = true;
+}
+
+bool pgzstreambuf::has_failed(void) {
+    std::lock_guard<std::mutex> guard(queue_mutex);
+    return failed && producer_done && queue.empty();
+}
+
+void pgzstreambuf::detect_format(void) {
+    // gzip magic, with the FEXTRA flag set and a BC subfield in the first header for BGZF
+    unsigned char header[16];
+    size_t n = fread(header, 1, sizeof(header), file);
+    if (n >= 2 && header[0] == 0x1f && header[1] == 0x8b) {
+        if (n >= 16 && (header[3] & 4) && header[12] == 'B' && header[13] == 'C') {
+            format = format_t::bgzf;
+        } else {
+            format = format_t::gzip;
+        }
+    } else {
+        format = format_t::plain;
+    }
+    fseek(file, 0, SEEK_SET);
+}
+
+void pgzstreambuf::produce(void) {
+    switch (format) {
+    case format_t::bgzf: produce_bgzf(); break;
+    case format_t::gzip: produce_gzip(); break;
+    default: produce_plain(); break;
+    }
+    {
+        std::lock_guard<std::mutex> guard(queue_mutex);
+        producer_done = true;
+    }
+    queue_cv.notify_all();
+}
+
+bool pgzstreambuf::push(std::vector<char>&& chunk) {
+    if (chunk.empty()) return true;
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    // a chunk larger than the bound still goes through, alone
+    queue_cv.wait(lock, [&](void) {
+            return queue.empty() || queued_bytes + chunk.size() <= max_queued_bytes || stopping;
+        });
+    if (stopping) return false;
+    queued_bytes += chunk.size();
+    queue.push_back(std::move(chunk));
+    lock.unlock();
+    queue_cv.notify_all();
+    return true;
+}
+
+void pgzstreambuf::produce_plain(void) {
+    const size_t chunk_size = 1 << 22;
+    while (true) {
+        std::vector<char> chunk(chunk_size);
+        size_t n = fread(chunk.data(), 1, chunk_size, file);
+        if (!n) {
+            if (ferror(file)) fail("read error");
+            break;
+        }
+        chunk.resize(n);
+        if (!push(std::move(chunk))) break;
+    }
+}
+
+void pgzstreambuf::produce_gzip(void) {
+    const size_t chunk_size = 1 << 22;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 15+32 lets zlib detect the gzip header itself
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        fail("could not initialize gzip decompression");
+        return;
+    }
+    std::vector<unsigned char> in(chunk_size);
+    bool more = true;
+    // whether we've fed zlib part of a member that it hasn't finished, which at the end of the file means it's truncated
+    bool in_member = false;
+    bool stopped = false;
+    while (more) {
+        if (zs.avail_in == 0) {
+            size_t n = fread(in.data(), 1, chunk_size, file);
+            if (!n) break;
+            zs.next_in = in.data();
+            zs.avail_in = n;
+        }
+        std::vector<char> out(chunk_size);
+        zs.next_out = (unsigned char*)out.data();
+        zs.avail_out = chunk_size;
+        while (zs.avail_out && (zs.avail_in || !feof(file))) {
+            if (zs.avail_in == 0) {
+                size_t n = fread(in.data(), 1, chunk_size, file);
+                if (!n) break;
+                zs.next_in = in.data();
+                zs.avail_in = n;
+            }
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // concatenated gzip members are allowed, so we keep going if there is more input
+                inflateReset(&zs);
+                in_member = false;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                fail("corrupt gzip data");
+                more = false;
+                break;
+            } else {
+                in_member = true;
+            }
+        }
+        if (ferror(file)) {
+            fail("read error");
+            more = false;
+        }
+        out.resize(chunk_size - zs.avail_out);
+        if (out.empty() && zs.avail_in == 0 && feof(file)) break;
+        if (!push(std::move(out))) {
+            stopped = true;
+            break;
+        }
+    }
+    if (in_member && !stopped) {
+        fail("truncated gzip data");
+    }
+    inflateEnd(&zs);
+}
+
+void pgzstreambuf::produce_bgzf(void) {
+    // read a batch of whole blocks, then inflate them in parallel
+    // batches are bounded in blocks per thread and in inflated bytes, which is enough to keep the threads busy
+    const size_t batch_size = 64 * n_threads;
+    const size_t max_batch_bytes = 16 << 20;
+    while (true) {
+        size_t batch_bytes = 0;
+        std::vector<std::vector<unsigned char>> blocks;
+        std::vector<size_t> header_lengths;
+        blocks.reserve(batch_size);
+        header_lengths.reserve(batch_size);
+        while (blocks.size() < batch_size && batch_bytes < max_batch_bytes) {
+            unsigned char header[12];
+            size_t n = fread(header, 1, 12, file);
+            if (n == 0 && !ferror(file)) break;
+            if (n != 12) {
+                fail("truncated BGZF block");
+                break;
+            }
+            if (header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4)) {
+                fail("malformed BGZF block");
+                break;
+            }
+            size_t xlen = header[10] | header[11] << 8;
+            std::vector<unsigned char> extra(xlen);
+            if (fread(extra.data(), 1, xlen, file) != xlen) {
+                fail("truncated BGZF block");
+                break;
+            }
+            // the BC subfield holds the total block size minus one
+            size_t block_size = 0;
+            for (size_t i = 0; i + 4 <= xlen; ) {
+                size_t slen = extra[i+2] | extra[i+3] << 8;
+                if (extra[i] == 'B' && extra[i+1] == 'C' && slen == 2 && i + 6 <= xlen) {
+                    block_size = (extra[i+4] | extra[i+5] << 8) + 1;
+                    break;
+                }
+                i += 4 + slen;
+            }
+            if (!block_size || block_size < 12 + xlen + 8) {
+                fail("malformed BGZF block");
+                break;
+            }
+            std::vector<unsigned char> block(block_size);
+            memcpy(block.data(), header, 12);
+            memcpy(block.data() + 12, extra.data(), xlen);
+            size_t rest = block_size - 12 - xlen;
+            if (fread(block.data() + 12 + xlen, 1, rest, file) != rest) {
+                fail("truncated BGZF block");
+                break;
+            }
+            // the trailer ends with the inflated size
+            batch_bytes += block[block_size-4] | block[block_size-3] << 8 | block[block_size-2] << 16 | (uint32_t)block[block_size-1] << 24;
+            blocks.push_back(std::move(block));
+            header_lengths.push_back(12 + xlen);
+        }
+        if (blocks.empty()) break;
+        std::vector<std::vector<char>> inflated(blocks.size());
+        bool batch_failed = false;
+#pragma omp parallel for num_threads(n_threads)
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            auto& block = blocks[i];
+            size_t h = header_lengths[i];
+            size_t n = block.size();
+            // the trailer holds the crc and then the inflated size
+            uint32_t crc = block[n-8] | block[n-7] << 8 | block[n-6] << 16 | (uint32_t)block[n-5] << 24;
+            uint32_t isize = block[n-4] | block[n-3] << 8 | block[n-2] << 16 | (uint32_t)block[n-1] << 24;
+            auto& out = inflated[i];
+            out.resize(isize);
+            if (!isize) continue;
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            bool ok = inflateInit2(&zs, -15) == Z_OK;
+            if (ok) {
+                zs.next_in = block.data() + h;
+                zs.avail_in = n - h - 8;
+                zs.next_out = (unsigned char*)out.data();
+                zs.avail_out = isize;
+                ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.avail_out == 0;
+                inflateEnd(&zs);
+            }
+            // raw deflate can decode damaged data without complaint, so we check it against the crc
+            ok = ok && crc32(0, (const unsigned char*)out.data(), isize) == crc;
+            if (!ok) {
+#pragma omp critical (bgzf_failed)
+                batch_failed = true;
+            }
+        }
+        if (batch_failed) {
+            fail("corrupt BGZF block");
+            break;
+        }
+        size_t total = 0;
+        for (auto& out : inflated) total += out.size();
+        std::vector<char> chunk;
+        chunk.reserve(total);
+        for (auto& out : inflated) {
+            chunk.insert(chunk.end(), out.begin(), out.end());
+        }
+        if (!push(std::move(chunk)) || failed) break;
+    }
+}
+
+bool pgzstreambuf::next_chunk(const char*& begin, const char*& end) {
+    try {
+        if (gptr() == egptr() && traits_type::eq_int_type(underflow(), traits_type::eof())) {
+            return false;
+        }
+    } catch (std::ios_base::failure&) {
+        return false;
+    }
+    begin = gptr();
+    end = egptr();
+    setg(eback(), egptr(), egptr());
+    return true;
+}
+
+std::streambuf::int_type pgzstreambuf::underflow(void) {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    queue_cv.wait(lock, [&](void) { return !queue.empty() || producer_done; });
+    if (queue.empty()) {
+        // the istream catches this and sets badbit, so a bad input doesn't look like a short one
+        if (failed) throw std::ios_base::failure("could not decode " + filename);
+        return traits_type::eof();
+    }
+    current = std::move(queue.front());
+    queue.pop_front();
+    queued_bytes -= current.size();
+    lock.unlock();
+    queue_cv.notify_all();
+    setg(current.data(), current.data(), current.data() + current.size());
+    return traits_type::to_int_type(*gptr());
+}
+
+}
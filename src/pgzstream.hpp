@@ -0,0 +1,99 @@
+#ifndef PGZSTREAM_HPP_INCLUDED
+#define PGZSTREAM_HPP_INCLUDED
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+#include "threads.hpp"
+
+namespace seqwish {
+
+// an input stream buffer which decompresses ahead of the reader on a background thread
+// BGZF files are split into their blocks and inflated in parallel, then handed out in order
+// plain gzip falls back to a single decompress-ahead thread, and uncompressed files are read ahead in large chunks
+class pgzstreambuf : public std::streambuf {
+
+private:
+
+    enum class format_t { plain, gzip, bgzf };
+    FILE* file = nullptr;
+    format_t format = format_t::plain;
+    int n_threads = 1;
+    std::thread producer;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<std::vector<char>> queue;
+    // decoded bytes held ahead of the reader, bounded so that several streams can read ahead at once
+    size_t queued_bytes = 0;
+    static const size_t max_queued_bytes = 64 << 20;
+    bool producer_done = false;
+    bool stopping = false;
+    // set by the producer when the input can't be decoded, and handed to the reader once it has the data before it
+    bool failed = false;
+    std::string filename;
+    void fail(const std::string& reason);
+    std::vector<char> current;
+    void detect_format(void);
+    void produce(void);
+    bool push(std::vector<char>&& chunk);
+    void produce_plain(void);
+    void produce_gzip(void);
+    void produce_bgzf(void);
+
+protected:
+
+    int_type underflow(void) override;
+
+public:
+
+    pgzstreambuf(void) { }
+    ~pgzstreambuf(void) { close(); }
+    bool open(const std::string& filename);
+    void close(void);
+    bool is_open(void) const { return file != nullptr; }
+    bool is_bgzf(void) const { return format == format_t::bgzf; }
+    // whether the input was corrupt or truncated, which the reader sees as an error after the last good data
+    bool has_failed(void);
+    // hand out the rest of the current decoded chunk without copying it, valid until the next read
+    bool next_chunk(const char*& begin, const char*& end);
+
+};
+
+class pgzstreambase : virtual public std::ios {
+protected:
+    pgzstreambuf buf;
+public:
+    pgzstreambase(void) { init(&buf); }
+    pgzstreambuf* rdbuf(void) { return &buf; }
+};
+
+// drop-in replacement for igzstream
+// input that can't be decoded sets badbit once the reader gets to it, so callers should check bad() when done
+class ipgzstream : public pgzstreambase, public std::istream {
+public:
+    ipgzstream(void) : std::istream(&buf) { }
+    ipgzstream(const char* name) : std::istream(&buf) { open(name); }
+    void open(const char* name) {
+        clear();
+        if (!buf.open(name)) setstate(std::ios::badbit);
+    }
+    void close(void) { buf.close(); }
+    bool is_open(void) const { return buf.is_open(); }
+    bool next_chunk(const char*& begin, const char*& end) {
+        if (buf.next_chunk(begin, end)) return true;
+        if (buf.has_failed()) setstate(std::ios::badbit);
+        return false;
+    }
+};
+
+}
+
+#endif
@@ -1,120 +1,477 @@
 #include "seqindex.hpp"
+#include "tokenize.hpp"
+#include "exists.hpp"
+#include "ips4o.hpp"
+#include <sstream>
+#include <tuple>
 
 namespace seqwish {
 
-// load a FASTA or FASTQ file into a file with a name index mapping name -> offset and indexed with a CSA
+namespace {
+
+// the .sqi is a header page followed by page-aligned sections that we map and use in place
+const uint64_t page_size = 4096;
+
+enum seqindex_section_t {
+    section_seq_names,
+    section_seq_name_offset,
+    section_seq_offset,
+    section_seq_name_rank,
+    section_seq_name_mphf,
+    section_seq_begin_words,
+    section_seq_begin_blocks,
+    section_fastafilename,
+    section_fai_offset,
+    section_fai_line_bases,
+    section_fai_line_width,
+    section_seq_dup,
+    n_sections
+};
+
+struct seqindex_header_t {
+    char magic[8];
+    uint64_t version;
+    input_fingerprint_t input_fingerprint;
+    uint64_t seq_count;
+    uint64_t faidx_mode;
+    uint64_t seq_name_seed;
+    uint64_t section_offset[n_sections];
+    uint64_t section_bytes[n_sections];
+};
+
+const char seqindex_magic[8] = { 's', 'e', 'q', 'i', 'd', 'x', 0, 0 };
+
+uint64_t page_align(uint64_t n) {
+    return (n + page_size - 1) / page_size * page_size;
+}
+
+bool read_header(const std::string& filename, seqindex_header_t& header) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    in.read((char*)&header, sizeof(header));
+    return in.good() && memcmp(header.magic, seqindex_magic, sizeof(seqindex_magic)) == 0;
+}
+
+// lets the mphf deserialize itself straight from the mapping
+struct section_streambuf : public std::streambuf {
+    section_streambuf(const char* begin, size_t bytes) {
+        char* b = const_cast<char*>(begin);
+        setg(b, b, b + bytes);
+    }
+};
+
+}
+
+// load a FASTA or FASTQ file into a file with a name index mapping name -> offset through a minimal perfect hash
 // provide queries over this index that let us extract particular positions and subsequences
 void seqindex_t::set_base_filename(const std::string& filename) {
     basefilename = filename;
     seqfilename = basefilename + ".sqq";
     seqidxfile = basefilename + ".sqi";
-    seqnamefile = basefilename + ".sqi.seqnames.tmp"; // used during construction
 }
 
 void seqindex_t::build_index(const std::string& filename, const std::string& idxbasename) {
     set_base_filename(idxbasename);
+    // an index left by an earlier run would describe the .sqq we're about to overwrite
+    std::remove(seqidxfile.c_str());
+    input_fingerprint = fingerprint(filename, false);
     // read the file
-    igzstream in(filename.c_str());
-    std::ofstream seqnames(seqnamefile.c_str());
-    std::ofstream seqout(seqfilename.c_str());
+    ipgzstream in(filename.c_str());
+    std::ostringstream seqnames;
+    packed_seq_writer_t seqout(seqfilename);
     std::vector<uint64_t> seqname_offset;
     std::vector<uint64_t> seq_offset;
-    bool input_is_fasta=false, input_is_fastq=false;
-    // look at the first character to determine if it's fastq or fasta
-    std::string line;
-    std::getline(in, line);
-    if (line[0] == '>') {
-        input_is_fasta = true;
-    } else if (line[0] == '@') {
-        input_is_fastq = true;
-    } else {
-        std::cerr << "unknown file format given to seqindex_t" << std::endl;
-        assert(false);
-    }
     size_t seq_bytes_written = 0;
     size_t seq_names_bytes_written = 0;
-    while (in.good()) {
-        seqname_offset.push_back(seq_names_bytes_written);
-        seq_offset.push_back(seq_bytes_written);
-        line[0] = '>';
-        line = line.substr(0, line.find(" "));
-        seqnames << line << " ";
-        seq_names_bytes_written += line.size() + 1;
-        std::string seq;
-        // get the sequence
-        if (input_is_fasta) {
-            while (std::getline(in, line)) {
-                if (line[0] == '>') {
-                    // this is the header of the next sequence
-                    break;
+    // we scan the decoded input block by block, packing sequence bytes straight into the output
+    auto append_seq = [&](const char* begin, const char* end) {
+        seqout.append(begin, end);
+        seq_bytes_written += end - begin;
+    };
+    enum { record_start, header, header_tail, seq_line_start, seq_line, plus_line, qual_line } state = record_start;
+    bool input_is_fastq = false;
+    bool first_record = true;
+    std::string name;
+    uint64_t record_seq_start = 0;
+    uint64_t qual_remaining = 0;
+    const char* p;
+    const char* end;
+    while (in.next_chunk(p, end)) {
+        while (p < end) {
+            switch (state) {
+            case record_start: {
+                if (*p == '\n') { ++p; break; } // skip blank lines between records
+                // look at the first character to determine if it's fastq or fasta
+                if (first_record) {
+                    if (*p == '@') {
+                        input_is_fastq = true;
+                    } else if (*p != '>') {
+                        std::cerr << "unknown file format given to seqindex_t" << std::endl;
+                        assert(false);
+                    }
+                    first_record = false;
+                }
+                seqname_offset.push_back(seq_names_bytes_written);
+                seq_offset.push_back(seq_bytes_written);
+                record_seq_start = seq_bytes_written;
+                name = ">";
+                ++p;
+                state = header;
+                break;
+            }
+            case header: {
+                // the name runs to the first space or the end of the line
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                const char* line_end = nl ? nl : end;
+                const char* sp = (const char*)memchr(p, ' ', line_end - p);
+                const char* name_end = sp ? sp : line_end;
+                name.append(p, name_end);
+                if (sp) {
+                    state = header_tail;
+                    p = sp;
+                } else if (nl) {
+                    p = nl;
+                    state = header_tail;
                 } else {
-                    seq.append(line);
+                    p = end;
                 }
+                if (state == header_tail) {
+                    seqnames << name << " ";
+                    seq_names_bytes_written += name.size() + 1;
+                }
+                break;
+            }
+            case header_tail: {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                if (nl) {
+                    p = nl + 1;
+                    state = seq_line_start;
+                } else {
+                    p = end;
+                }
+                break;
+            }
+            case seq_line_start: {
+                if (!input_is_fastq && *p == '>') {
+                    state = record_start;
+                } else if (input_is_fastq && *p == '+') {
+                    state = plus_line;
+                } else {
+                    state = seq_line;
+                }
+                break;
+            }
+            case seq_line: {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                if (nl) {
+                    append_seq(p, nl);
+                    p = nl + 1;
+                    state = seq_line_start;
+                } else {
+                    append_seq(p, end);
+                    p = end;
+                }
+                break;
+            }
+            case plus_line: {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                if (nl) {
+                    p = nl + 1;
+                    // the quality string is as long as the sequence, possibly over several lines
+                    qual_remaining = seq_bytes_written - record_seq_start;
+                    state = qual_remaining ? qual_line : record_start;
+                } else {
+                    p = end;
+                }
+                break;
+            }
+            case qual_line: {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                const char* line_end = nl ? nl : end;
+                qual_remaining -= std::min(qual_remaining, (uint64_t)(line_end - p));
+                p = nl ? nl + 1 : end;
+                if (nl && !qual_remaining) {
+                    state = record_start;
+                }
+                break;
+            }
             }
-        } else if (input_is_fastq) {
-            std::getline(in, seq); // sequence
-            std::getline(in, line); // delimiter
-            std::getline(in, line); // quality
-            std::getline(in, line);
         }
-        seqout << seq;
-        // record where the sequence starts
-        seq_bytes_written += seq.size();
+    }
+    if (in.bad()) exit(1); // the stream has said what was wrong with the input
+    // a header at the very end of the input without a newline still names a (empty) sequence
+    if (state == header) {
+        seqnames << name << " ";
+        seq_names_bytes_written += name.size() + 1;
     }
     in.close();
     // add the last value so we can get sequence length for the last sequence and name
     seq_offset.push_back(seq_bytes_written);
     seqname_offset.push_back(seq_names_bytes_written);
-    seqnames.close();
     seqout.close();
+    build_dictionaries(seqnames.str(), std::move(seqname_offset), std::move(seq_offset));
+    open_seq(seqfilename);
+}
+
+void seqindex_t::build_dictionaries(const std::string& names,
+                                    std::vector<uint64_t>&& name_offsets,
+                                    std::vector<uint64_t>&& seq_offsets) {
+    close_idx();
     // save the count of sequences
-    seq_count = seqname_offset.size()-1;
-    // mark the seq name starts vector, adding a terminating mark
-    sdsl::bit_vector seq_name_starts(seqname_offset.back()+1);
-    for (size_t i = 0; i < seqname_offset.size(); ++i) {
-        seq_name_starts[seqname_offset[i]] = 1;
-    }
+    seq_count = name_offsets.size()-1;
+    seq_names.assign(std::vector<char>(names.begin(), names.end()));
+    seq_name_offset.assign(std::move(name_offsets));
+    seq_offset.assign(std::move(seq_offsets));
     // build the name index
-    construct(seq_name_csa, seqnamefile, 1);
-    // destroy the file
-    std::remove(seqnamefile.c_str());
-    // build the rest of the index
-    sdsl::util::assign(seq_name_cbv, sdsl::sd_vector<>(seq_name_starts));
-    sdsl::util::assign(seq_name_cbv_rank, sdsl::sd_vector<>::rank_1_type(&seq_name_cbv));
-    sdsl::util::assign(seq_name_cbv_select, sdsl::sd_vector<>::select_1_type(&seq_name_cbv));
-    // mark the seq begin vector, adding a terminating mark
-    sdsl::bit_vector seq_begin_bv(seq_offset.back()+1);
-    for (size_t i = 0; i < seq_offset.size(); ++i) {
-        seq_begin_bv[seq_offset[i]] = 1;
-    }
-    sdsl::util::assign(seq_begin_cbv, sdsl::sd_vector<>(seq_begin_bv));
-    sdsl::util::assign(seq_begin_cbv_rank, sdsl::sd_vector<>::rank_1_type(&seq_begin_cbv));
-    sdsl::util::assign(seq_begin_cbv_select, sdsl::sd_vector<>::select_1_type(&seq_begin_cbv));
-    //std::cerr << seq_offset_civ << std::endl;
-    // validate
-    // look up each sequence by name
+    build_name_mphf();
+    build_seq_begin_rank();
+}
+
+uint64_t seqindex_t::hash_name(const char* name, size_t len, uint64_t seed) {
+    // murmur3 finalizer over 8 byte words
+    auto mix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+    uint64_t h = mix(seed ^ (len * 0x9e3779b97f4a7c15ULL));
+    size_t i = 0;
+    for ( ; i + 8 <= len; i += 8) {
+        uint64_t k;
+        memcpy(&k, name + i, 8);
+        h = mix(h ^ mix(k));
+    }
+    uint64_t k = 0;
+    memcpy(&k, name + i, len - i);
+    return mix(h ^ mix(k));
+}
+
+// the name of sequence n sits between its '>' and the following ' ' in seq_names
+void seqindex_t::name_extent(size_t n, size_t& begin, size_t& length) const {
+    begin = seq_name_offset[n-1]+1;
+    length = seq_name_offset[n]-1-begin;
+}
+
+void seqindex_t::build_name_mphf(void) {
+    seq_name_rank.clear();
+    seq_name_mphf.reset();
+    if (seq_count == 0) return;
+    std::vector<uint64_t> keys(seq_count);
+    std::vector<std::pair<uint64_t, uint64_t>> sorted_keys(seq_count);
+    // the mphf can't take duplicate keys, so we reseed the name hash until it has none
+    for (seq_name_seed = 0; ; ++seq_name_seed) {
+#pragma omp parallel for schedule(static)
+        for (size_t i = 1; i <= seq_count; ++i) {
+            size_t begin, length;
+            name_extent(i, begin, length);
+            keys[i-1] = hash_name(seq_names.data() + begin, length, seq_name_seed);
+            sorted_keys[i-1] = std::make_pair(keys[i-1], i);
+        }
+        ips4o::parallel::sort(sorted_keys.begin(), sorted_keys.end());
+        bool collision = false;
+        for (size_t i = 1; i < seq_count; ++i) {
+            if (sorted_keys[i-1].first == sorted_keys[i].first) {
+                if (nth_name(sorted_keys[i-1].second) == nth_name(sorted_keys[i].second)) {
+                    std::cerr << "[seqwish] ERROR: sequence name " << nth_name(sorted_keys[i].second)
+                              << " is used more than once in the input" << std::endl;
+                    exit(1);
+                }
+                collision = true;
+                break;
+            }
+        }
+        if (!collision) break;
+    }
+    sorted_keys.clear();
+    sorted_keys.shrink_to_fit();
+    auto key_range = boomphf::range(keys.begin(), keys.end());
+    seq_name_mphf.reset(new boophf_t(seq_count, key_range, get_thread_count(), 2.0, false, false));
+    std::vector<uint64_t> rank(seq_count);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 1; i <= seq_count; ++i) {
+        rank[seq_name_mphf->lookup(keys[i-1])] = i;
+    }
+    seq_name_rank.assign(std::move(rank));
+}
+
+bool seqindex_t::fai_record_fits(uint64_t length, uint64_t offset, uint64_t line_bases, uint64_t line_width) const {
+    if (!length) return offset <= seq_size;
+    // every full line has to end in a newline, and the last line has to lie inside the file
+    uint64_t full_lines = (length - 1) / line_bases;
+    uint64_t last_bases = length - full_lines * line_bases;
+    if (offset > seq_size
+        || full_lines > (seq_size - offset) / line_width
+        || offset + full_lines * line_width + last_bases > seq_size) {
+        return false;
+    }
+    for (uint64_t i = 0; i < full_lines; ++i) {
+        if (seq_buf[offset + (i + 1) * line_width - 1] != '\n') return false;
+    }
+    // the last line may be the end of the file, without a newline
+    uint64_t last_end = offset + full_lines * line_width + last_bases;
+    uint64_t newline = last_end + (line_width - line_bases) - 1;
+    return last_end == seq_size || (newline < seq_size && seq_buf[newline] == '\n');
+}
+
+void seqindex_t::build_index_from_faidx(const std::string& filename, const std::string& idxbasename) {
+    set_base_filename(idxbasename);
+    std::remove(seqidxfile.c_str());
+    input_fingerprint = fingerprint(filename, true);
+    fastafilename = filename;
+    faidx_mode = true;
+    std::vector<uint64_t> offsets, line_bases_v, line_width_v;
+    std::vector<uint64_t> seqname_offset;
+    std::vector<uint64_t> seq_offset;
+    size_t seq_bytes = 0;
+    size_t seq_names_bytes_written = 0;
+    std::ostringstream seqnames;
+    auto add_record = [&](const std::string& name, uint64_t length, uint64_t offset,
+                          uint64_t line_bases, uint64_t line_width) {
+        seqname_offset.push_back(seq_names_bytes_written);
+        seq_offset.push_back(seq_bytes);
+        seqnames << ">" << name << " ";
+        seq_names_bytes_written += name.size() + 2;
+        seq_bytes += length;
+        offsets.push_back(offset);
+        line_bases_v.push_back(line_bases);
+        line_width_v.push_back(line_width);
+    };
+    if (!open_seq(fastafilename)) {
+        std::cerr << "[seqwish] ERROR: could not map " << filename << std::endl;
+        exit(1);
+    }
+    // neither a .fai nor our own scan can make sense of compressed bytes
+    if (seq_size >= 2 && (uint8_t)seq_buf[0] == 0x1f && (uint8_t)seq_buf[1] == 0x8b) {
+        std::cerr << "[seqwish] ERROR: " << filename << " is compressed and can't be used in place" << std::endl;
+        exit(1);
+    }
+    std::string fai_file = filename + ".fai";
+    if (file_exists(fai_file)) {
+        // name, length, offset, line bases, line width
+        std::ifstream fai(fai_file.c_str());
+        std::string line;
+        uint64_t line_no = 0;
+        while (std::getline(fai, line)) {
+            ++line_no;
+            if (line.empty()) continue;
+            std::vector<std::string> fields;
+            tokenize(line, fields, "\t");
+            uint64_t length, offset, line_bases, line_width;
+            if (fields.size() < 5 || fields[0].empty()
+                || !parse_uint(fields[1], length)
+                || !parse_uint(fields[2], offset)
+                || !parse_uint(fields[3], line_bases)
+                || !parse_uint(fields[4], line_width)
+                || (length && (!line_bases || line_width <= line_bases))) {
+                std::cerr << "[seqwish] ERROR: line " << line_no << " of " << fai_file << " is not a valid .fai record" << std::endl;
+                exit(1);
+            }
+            if (!fai_record_fits(length, offset, line_bases, line_width)) {
+                std::cerr << "[seqwish] ERROR: " << fields[0] << " in " << fai_file << " does not match the lines of "
+                          << filename << ", which may have changed since it was indexed" << std::endl;
+                exit(1);
+            }
+            add_record(fields[0], length, offset, line_bases, line_width);
+        }
+    } else {
+        // build the equivalent of a .fai by scanning the mapped file
+        const char* p = seq_buf;
+        const char* end = seq_buf + seq_size;
+        while (p < end) {
+            if (*p == '\n') { ++p; continue; }
+            if (*p != '>') {
+                std::cerr << "[seqwish] ERROR: " << filename << " is not a FASTA file" << std::endl;
+                exit(1);
+            }
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if (!nl) nl = end;
+            const char* sp = (const char*)memchr(p, ' ', nl - p);
+            std::string name(p + 1, sp ? sp : nl);
+            p = std::min(nl + 1, end);
+            uint64_t offset = p - seq_buf;
+            uint64_t length = 0, line_bases = 0, line_width = 0;
+            bool last_line = false;
+            while (p < end && *p != '>') {
+                const char* line_end = (const char*)memchr(p, '\n', end - p);
+                if (!line_end) line_end = end;
+                uint64_t width = line_end - p + (line_end < end);
+                uint64_t bases = line_end - p - (line_end > p && line_end[-1] == '\r');
+                if (!line_bases) {
+                    line_bases = bases;
+                    line_width = width;
+                } else if (last_line || bases > line_bases || (bases == line_bases && width != line_width)) {
+                    if (bases) {
+                        std::cerr << "[seqwish] ERROR: " << name << " in " << filename
+                                  << " has uneven line lengths and can't be used in place" << std::endl;
+                        exit(1);
+                    }
+                }
+                last_line = last_line || bases < line_bases;
+                length += bases;
+                p = std::min(line_end + 1, end);
+            }
+            add_record(name, length, offset, line_bases, line_width);
+        }
+    }
+    seq_offset.push_back(seq_bytes);
+    seqname_offset.push_back(seq_names_bytes_written);
+    build_dictionaries(seqnames.str(), std::move(seqname_offset), std::move(seq_offset));
+    fai_offset.assign(std::move(offsets));
+    fai_line_bases.assign(std::move(line_bases_v));
+    fai_line_width.assign(std::move(line_width_v));
 }
 
 size_t seqindex_t::save(sdsl::structure_tree_node* s, std::string name) {
-    //assert(seq_name_csa.size() && seq_name_cbv.size() && seq_offset_civ.size());
-    sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
-    // open the sdsl index
-    std::ofstream out(seqidxfile.c_str());
-    size_t written = 0;
-    out << "seqidx"; written += 9;
-    uint32_t version_buffer = OUTPUT_VERSION;
-    out.write((char*) &version_buffer, sizeof(version_buffer));
-    written += sdsl::write_member(seq_count, out, child, "seq_count");
-    written += seq_name_csa.serialize(out, child, "seq_name_csa");
-    written += seq_name_cbv.serialize(out, child, "seq_name_cbv");
-    written += seq_name_cbv_rank.serialize(out, child, "seq_name_cbv_rank");
-    written += seq_name_cbv_select.serialize(out, child, "seq_name_cbv_select");
-    written += seq_begin_cbv.serialize(out, child, "seq_begin_cbv");
-    written += seq_begin_cbv_rank.serialize(out, child, "seq_begin_cbv_rank");
-    written += seq_begin_cbv_select.serialize(out, child, "seq_begin_cbv_select");
+    std::ostringstream mphf_out;
+    if (seq_name_mphf) seq_name_mphf->save(mphf_out);
+    std::string mphf_bytes = mphf_out.str();
+    seqindex_header_t header = seqindex_header_t();
+    memcpy(header.magic, seqindex_magic, sizeof(seqindex_magic));
+    header.version = OUTPUT_VERSION;
+    header.input_fingerprint = input_fingerprint;
+    header.seq_count = seq_count;
+    header.faidx_mode = faidx_mode;
+    header.seq_name_seed = seq_name_seed;
+    std::pair<const char*, size_t> sections[n_sections];
+    sections[section_seq_names] = { seq_names.data(), seq_names.bytes() };
+    sections[section_seq_name_offset] = { (const char*)seq_name_offset.data(), seq_name_offset.bytes() };
+    sections[section_seq_offset] = { (const char*)seq_offset.data(), seq_offset.bytes() };
+    sections[section_seq_name_rank] = { (const char*)seq_name_rank.data(), seq_name_rank.bytes() };
+    sections[section_seq_name_mphf] = { mphf_bytes.data(), mphf_bytes.size() };
+    sections[section_seq_begin_words] = { (const char*)seq_begin_words.data(), seq_begin_words.bytes() };
+    sections[section_seq_begin_blocks] = { (const char*)seq_begin_blocks.data(), seq_begin_blocks.bytes() };
+    sections[section_fastafilename] = { fastafilename.data(), faidx_mode ? fastafilename.size() : 0 };
+    sections[section_fai_offset] = { (const char*)fai_offset.data(), fai_offset.bytes() };
+    sections[section_fai_line_bases] = { (const char*)fai_line_bases.data(), fai_line_bases.bytes() };
+    sections[section_fai_line_width] = { (const char*)fai_line_width.data(), fai_line_width.bytes() };
+    sections[section_seq_dup] = { (const char*)seq_dup.data(), seq_dup.bytes() };
+    uint64_t offset = page_align(sizeof(header));
+    for (size_t i = 0; i < n_sections; ++i) {
+        header.section_offset[i] = offset;
+        header.section_bytes[i] = sections[i].second;
+        offset += page_align(sections[i].second);
+    }
+    // we write to a temporary file and rename it into place, so a run that dies while saving
+    // never leaves a header in front of missing sections
+    std::string tmpfile = seqidxfile + ".tmp";
+    std::ofstream out(tmpfile.c_str(), std::ios::binary);
+    const std::vector<char> padding(page_size, 0);
+    out.write((const char*)&header, sizeof(header));
+    out.write(padding.data(), page_align(sizeof(header)) - sizeof(header));
+    for (size_t i = 0; i < n_sections; ++i) {
+        if (sections[i].second) out.write(sections[i].first, sections[i].second);
+        out.write(padding.data(), page_align(sections[i].second) - sections[i].second);
+    }
     out.close();
-    open_seq(seqfilename);
-    return written;
+    if (out.fail() || std::rename(tmpfile.c_str(), seqidxfile.c_str()) != 0) {
+        std::cerr << "[seqwish] ERROR: could not write the sequence index " << seqidxfile << std::endl;
+        std::remove(tmpfile.c_str());
+        exit(1);
+    }
+    open_seq(faidx_mode ? fastafilename : seqfilename);
+    return offset;
 }
 
 void seqindex_t::remove_index_files(void) {
@@ -122,29 +479,39 @@ void seqindex_t::remove_index_files(void) {
     std::remove(seqidxfile.c_str());
 }
 
-void seqindex_t::open_seq(const std::string& filename) {
-    if (seq_fd) return; //open
+bool seqindex_t::open_seq(const std::string& filename) {
+    if (seq_fd) return true; //open
     assert(!filename.empty());
     // open in binary mode as we are reading from this interface
-    seq_fd = open(filename.c_str(), O_RDWR);
+    // neither the packed sequence nor an input FASTA is ever written through the mapping
+    seq_fd = open(filename.c_str(), O_RDONLY);
     if (seq_fd == -1) {
-        assert(false);
+        seq_fd = 0;
+        return false;
     }
     struct stat stats;
     if (-1 == fstat(seq_fd, &stats)) {
-        assert(false);
+        close_seq();
+        return false;
     }
     seq_size = stats.st_size;
-    if (!(seq_buf =
-          (char*) mmap(NULL,
-                       seq_size,
-                       PROT_READ | PROT_WRITE,
-                       MAP_SHARED,
-                       seq_fd,
-                       0))) {
-        assert(false);
+    seq_buf = (char*) mmap(NULL,
+                           seq_size,
+                           PROT_READ,
+                           MAP_SHARED,
+                           seq_fd,
+                           0);
+    if (seq_buf == MAP_FAILED) {
+        seq_buf = nullptr;
+        close_seq();
+        return false;
     }
     madvise((void*)seq_buf, seq_size, POSIX_MADV_WILLNEED | POSIX_MADV_SEQUENTIAL);
+    if (!faidx_mode && !packed_seq.attach(seq_buf, seq_size)) {
+        close_seq();
+        return false;
+    }
+    return true;
 }
 
 void seqindex_t::close_seq(void) {
@@ -158,24 +525,145 @@ void seqindex_t::close_seq(void) {
     }
 }
 
+void seqindex_t::close_idx(void) {
+    if (idx_buf) {
+        munmap(idx_buf, idx_size);
+        idx_buf = nullptr;
+        idx_size = 0;
+    }
+}
+
 void seqindex_t::load(const std::string& filename) {
+    if (!map_index(filename)) {
+        std::cerr << "[seqwish] ERROR: " << seqidxfile << " or its sequence is missing, incomplete, or not of index version "
+                  << OUTPUT_VERSION << std::endl;
+        exit(1);
+    }
+}
+
+bool seqindex_t::map_index(const std::string& filename) {
+    close_seq();
+    close_idx();
     set_base_filename(filename);
-    std::ifstream in(seqidxfile.c_str());
-    std::string magic;
-    in.read((char*)magic.c_str(), 6);
-    uint32_t version;
-    in.read((char*) &version, sizeof(version));
-    assert(version == OUTPUT_VERSION);
-    sdsl::read_member(seq_count, in);
-    seq_name_csa.load(in);
-    seq_name_cbv.load(in);
-    seq_name_cbv_rank.load(in);
-    seq_name_cbv_select.load(in);
-    seq_begin_cbv.load(in);
-    seq_begin_cbv_rank.load(in);
-    seq_begin_cbv_select.load(in);
-    in.close(); // close the sdsl index input
-    open_seq(filename);
+    int fd = open(seqidxfile.c_str(), O_RDONLY);
+    struct stat stats;
+    if (fd == -1 || fstat(fd, &stats) == -1) {
+        if (fd != -1) close(fd);
+        return false;
+    }
+    idx_size = stats.st_size;
+    idx_buf = (char*) mmap(NULL, idx_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (idx_buf == MAP_FAILED) {
+        idx_buf = nullptr;
+        idx_size = 0;
+        return false;
+    }
+    const seqindex_header_t* header = (const seqindex_header_t*)idx_buf;
+    if (idx_size < sizeof(seqindex_header_t)
+        || memcmp(header->magic, seqindex_magic, sizeof(seqindex_magic)) != 0
+        || header->version != OUTPUT_VERSION) {
+        close_idx();
+        return false;
+    }
+    // every section has to lie inside the file, and the per-sequence arrays have to cover every sequence
+    for (size_t i = 0; i < n_sections; ++i) {
+        if (header->section_offset[i] > idx_size
+            || header->section_bytes[i] > idx_size - header->section_offset[i]) {
+            close_idx();
+            return false;
+        }
+    }
+    uint64_t per_seq_bytes = (header->seq_count + 1) * sizeof(uint64_t);
+    if (header->section_bytes[section_seq_offset] != per_seq_bytes
+        || header->section_bytes[section_seq_name_offset] != per_seq_bytes
+        // the duplicate table is only there if a run has collapsed duplicates
+        || (header->section_bytes[section_seq_dup] != 0
+            && header->section_bytes[section_seq_dup] != header->seq_count * sizeof(uint64_t))) {
+        close_idx();
+        return false;
+    }
+    input_fingerprint = header->input_fingerprint;
+    seq_count = header->seq_count;
+    faidx_mode = header->faidx_mode;
+    seq_name_seed = header->seq_name_seed;
+    auto section = [&](size_t i) { return (const char*)idx_buf + header->section_offset[i]; };
+    auto bytes = [&](size_t i) { return header->section_bytes[i]; };
+    seq_names.map(section(section_seq_names), bytes(section_seq_names));
+    seq_name_offset.map(section(section_seq_name_offset), bytes(section_seq_name_offset));
+    seq_offset.map(section(section_seq_offset), bytes(section_seq_offset));
+    seq_name_rank.map(section(section_seq_name_rank), bytes(section_seq_name_rank));
+    seq_begin_words.map(section(section_seq_begin_words), bytes(section_seq_begin_words));
+    seq_begin_blocks.map(section(section_seq_begin_blocks), bytes(section_seq_begin_blocks));
+    fastafilename.assign(section(section_fastafilename), bytes(section_fastafilename));
+    fai_offset.map(section(section_fai_offset), bytes(section_fai_offset));
+    fai_line_bases.map(section(section_fai_line_bases), bytes(section_fai_line_bases));
+    fai_line_width.map(section(section_fai_line_width), bytes(section_fai_line_width));
+    seq_dup.map(section(section_seq_dup), bytes(section_seq_dup));
+    // the mphf is the one structure we deserialize, but it's only a few bits per name
+    seq_name_mphf.reset();
+    if (seq_count) {
+        section_streambuf buf(section(section_seq_name_mphf), bytes(section_seq_name_mphf));
+        std::istream in(&buf);
+        seq_name_mphf.reset(new boophf_t());
+        seq_name_mphf->load(in);
+    }
+    // the packed sequence has to be complete and as long as the index says
+    if (!open_seq(faidx_mode ? fastafilename : seqfilename)
+        || (!faidx_mode && packed_seq.size() != seq_length())) {
+        seq_name_mphf.reset();
+        close_seq();
+        close_idx();
+        return false;
+    }
+    return true;
+}
+
+input_fingerprint_t seqindex_t::fingerprint(const std::string& filename, bool in_place) {
+    input_fingerprint_t fp;
+    fp.in_place = in_place;
+    struct stat stats;
+    if (stat(filename.c_str(), &stats) == -1) return fp;
+    fp.size = stats.st_size;
+    fp.mtime = stats.st_mtime;
+    // a few hundred kb spread over the file catches edits that keep the size and time
+    const uint64_t n_samples = 64;
+    const uint64_t sample_size = 4096;
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    std::vector<char> buf(sample_size);
+    uint64_t h = fp.size;
+    for (uint64_t i = 0; i < n_samples; ++i) {
+        uint64_t pos = fp.size > sample_size ? (fp.size - sample_size) / (n_samples - 1) * i : 0;
+        in.seekg(pos);
+        in.read(buf.data(), sample_size);
+        h = hash_name(buf.data(), in.gcount(), h);
+        in.clear();
+        if (fp.size <= sample_size) break;
+    }
+    fp.sample_hash = h;
+    // the offsets we read in place come from the .fai if there is one, so it has to be unchanged too
+    std::string fai_file = filename + ".fai";
+    if (in_place && stat(fai_file.c_str(), &stats) != -1) {
+        uint64_t fai_stats[2] = { (uint64_t)stats.st_size, (uint64_t)stats.st_mtime };
+        fp.fai_hash = hash_name((const char*)fai_stats, sizeof(fai_stats), h) | 1;
+    }
+    return fp;
+}
+
+bool seqindex_t::load_if_current(const std::string& filename, const std::string& idxbasename, bool in_place) {
+    set_base_filename(idxbasename);
+    if (!file_exists(seqidxfile) || (!in_place && !file_exists(seqfilename))) return false;
+    seqindex_header_t header;
+    if (!read_header(seqidxfile, header)
+        || header.version != OUTPUT_VERSION
+        || !(header.input_fingerprint == fingerprint(filename, in_place))) {
+        return false;
+    }
+    if (!map_index(idxbasename)) {
+        std::cerr << "[seqwish] WARNING: rebuilding the damaged sequence index " << seqidxfile << std::endl;
+        return false;
+    }
+    return true;
 }
 
 void seqindex_t::to_fasta(std::ostream& out, size_t linewidth) const {
@@ -196,28 +684,40 @@ void seqindex_t::to_fasta(std::ostream& out, size_t linewidth) const {
 
 std::string seqindex_t::nth_name(size_t n) const {
     // get the extents from our seq name dictionary
-    size_t begin = seq_name_cbv_select(n)+1; // step past '>' delimiter
-    size_t end = seq_name_cbv_select(n+1)-2; // step back past added ' '
-    std::string name = sdsl::extract(seq_name_csa, begin, end);
-    return name;
+    size_t begin, length;
+    name_extent(n, begin, length);
+    return std::string(seq_names.data() + begin, length);
+}
+
+size_t seqindex_t::find_seq_named(const std::string& name) const {
+    if (!seq_name_mphf) return 0;
+    // the mphf sends unknown names to arbitrary slots, so we check the name stored for the rank we get
+    uint64_t idx = seq_name_mphf->lookup(hash_name(name.c_str(), name.size(), seq_name_seed));
+    if (idx >= seq_count) return 0;
+    size_t rank = seq_name_rank[idx];
+    size_t begin, length;
+    name_extent(rank, begin, length);
+    if (length != name.size() || memcmp(seq_names.data() + begin, name.c_str(), length) != 0) return 0;
+    return rank;
 }
 
 size_t seqindex_t::rank_of_seq_named(const std::string& name) const {
-    std::string query = ">" + name + " ";
-    //std::cerr << query << std::endl;
-    auto occs = locate(seq_name_csa, query);
-    //std::cerr << "occurs " << occs << std::endl;
-    assert(occs.size() == 1);
-    return seq_name_cbv_rank(occs[0])+1;
+    size_t rank = find_seq_named(name);
+    assert(rank != 0);
+    return rank;
+}
+
+bool seqindex_t::has_seq_named(const std::string& name) const {
+    return find_seq_named(name) != 0;
 }
 
 size_t seqindex_t::nth_seq_length(size_t n) const {
     //std::cerr << "trying for "  << n << std::endl;
-    return seq_begin_cbv_select(n+1)-seq_begin_cbv_select(n);
+    return seq_offset[n]-seq_offset[n-1];
 }
 
 size_t seqindex_t::nth_seq_offset(size_t n) const {
-    return seq_begin_cbv_select(n);
+    return seq_offset[n-1];
 }
 
 std::string seqindex_t::seq(const std::string& name) const {
@@ -235,10 +735,42 @@ std::string seqindex_t::subseq(size_t n, size_t pos, size_t count) const {
 
 std::string seqindex_t::subseq(size_t pos, size_t count) const {
     std::string s; s.resize(count);
-    memcpy((void*)s.c_str(), &seq_buf[pos], count);
+    if (!faidx_mode) {
+        packed_seq.decode(pos, count, (char*)s.c_str());
+    } else {
+        // copy line by line out of the wrapped records
+        size_t i = 0;
+        while (i < count) {
+            size_t n = seq_id_at(pos + i);
+            size_t in_seq = pos + i - nth_seq_offset(n);
+            size_t line_rest = fai_line_bases[n-1] - in_seq % fai_line_bases[n-1];
+            size_t seq_rest = nth_seq_length(n) - in_seq;
+            size_t len = std::min(count - i, std::min(line_rest, seq_rest));
+            memcpy((void*)(s.c_str() + i), &seq_buf[fasta_offset(pos + i)], len);
+            i += len;
+        }
+    }
     return s;
 }
 
+std::string seqindex_t::rev_comp_subseq(size_t pos, size_t count) const {
+    if (!faidx_mode) {
+        std::string s; s.resize(count);
+        packed_seq.decode_rev_comp(pos, count, (char*)s.c_str());
+        return s;
+    } else {
+        return dna_reverse_complement(subseq(pos, count));
+    }
+}
+
+size_t seqindex_t::fasta_offset(size_t pos) const {
+    size_t n = seq_id_at(pos);
+    size_t in_seq = pos - nth_seq_offset(n);
+    return fai_offset[n-1]
+        + in_seq / fai_line_bases[n-1] * fai_line_width[n-1]
+        + in_seq % fai_line_bases[n-1];
+}
+
 size_t seqindex_t::pos_in_all_seqs(const std::string& name, size_t pos, bool is_rev) const {
     return pos_in_all_seqs(rank_of_seq_named(name), pos, is_rev);
 }
@@ -249,11 +781,11 @@ size_t seqindex_t::pos_in_all_seqs(size_t n, size_t pos, bool is_rev) const {
 }
 
 size_t seqindex_t::seq_length(void) const {
-    return seq_begin_cbv.size()-1;
+    return seq_offset.size() ? seq_offset[seq_count] : 0;
 }
 
 char seqindex_t::at(size_t pos) const {
-    return seq_buf[pos];
+    return faidx_mode ? seq_buf[fasta_offset(pos)] : packed_seq.at(pos);
 }
 
 char seqindex_t::at_pos(pos_t pos) const {
@@ -270,11 +802,137 @@ size_t seqindex_t::n_seqs(void) const {
 }
 
 size_t seqindex_t::seq_id_at(size_t pos) const {
-    return seq_begin_cbv_rank(pos+1);
+    if (seq_begin_words.size()) {
+        // rank of pos+1, which counts the starts at or before pos
+        size_t i = pos + 1;
+        size_t w = i >> 6;
+        size_t r = seq_begin_blocks[w >> 3];
+        for (size_t j = w & ~(size_t)7; j < w; ++j) {
+            r += __builtin_popcountll(seq_begin_words[j]);
+        }
+        if (i & 63) r += __builtin_popcountll(seq_begin_words[w] & (((uint64_t)1 << (i & 63)) - 1));
+        return r;
+    } else {
+        // the offsets are sorted, and with empty sequences we want the last of equal ones
+        return std::upper_bound(seq_offset.begin(), seq_offset.end(), pos) - seq_offset.begin();
+    }
+}
+
+void seqindex_t::build_seq_begin_rank(void) {
+    // with many short sequences (reads) cursors rarely stay inside one sequence,
+    // so we pay 1.125 bits per base for constant time rank instead of a binary search over the offsets
+    seq_begin_words.clear();
+    seq_begin_blocks.clear();
+    if (seq_count == 0 || seq_length() / seq_count >= dense_rank_max_mean_length) return;
+    for (size_t i = 1; i <= seq_count; ++i) {
+        // a bit per start can't count empty sequences
+        if (seq_offset[i] == seq_offset[i-1]) return;
+    }
+    std::vector<uint64_t> words(seq_length() / 64 + 1, 0);
+    for (size_t i = 0; i <= seq_count; ++i) {
+        words[seq_offset[i] >> 6] |= (uint64_t)1 << (seq_offset[i] & 63);
+    }
+    std::vector<uint64_t> blocks(words.size() / 8 + 1, 0);
+    uint64_t count = 0;
+    for (size_t j = 0; j < words.size(); ++j) {
+        if (j % 8 == 0) blocks[j / 8] = count;
+        count += __builtin_popcountll(words[j]);
+    }
+    if (words.size() % 8 == 0) blocks[words.size() / 8] = count;
+    seq_begin_words.assign(std::move(words));
+    seq_begin_blocks.assign(std::move(blocks));
+}
+
+namespace {
+// sequences are hashed and compared in pieces of this size, so long ones don't need a full copy
+const uint64_t dup_chunk_size = 1 << 20;
+}
+
+// whether sequence a is identical to sequence b, or to its reverse complement if b_rev
+bool seqindex_t::same_seq(size_t a, size_t b, bool b_rev) const {
+    uint64_t len = nth_seq_length(a);
+    if (nth_seq_length(b) != len) return false;
+    uint64_t a_begin = nth_seq_offset(a);
+    uint64_t b_begin = nth_seq_offset(b);
+    for (uint64_t i = 0; i < len; i += dup_chunk_size) {
+        uint64_t count = std::min(dup_chunk_size, len - i);
+        if (subseq(a_begin + i, count)
+            != (b_rev ? rev_comp_subseq(b_begin + len - i - count, count) : subseq(b_begin + i, count))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void seqindex_t::build_seq_dups(void) {
+    seq_dup.clear();
+    if (seq_count == 0) return;
+    // key each sequence by its length and the smaller of its forward and reverse complement hashes,
+    // so that copies in either orientation sort next to each other
+    std::vector<std::tuple<uint64_t, uint64_t, uint64_t>> keys(seq_count);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 1; i <= seq_count; ++i) {
+        uint64_t len = nth_seq_length(i);
+        uint64_t begin = nth_seq_offset(i);
+        uint64_t fwd = 0, rev = 0;
+        for (uint64_t j = 0; j < len; j += dup_chunk_size) {
+            uint64_t count = std::min(dup_chunk_size, len - j);
+            std::string f = subseq(begin + j, count);
+            std::string r = rev_comp_subseq(begin + len - j - count, count);
+            fwd = hash_name(f.data(), f.size(), fwd);
+            rev = hash_name(r.data(), r.size(), rev);
+        }
+        keys[i-1] = std::make_tuple(len, std::min(fwd, rev), i);
+    }
+    ips4o::parallel::sort(keys.begin(), keys.end());
+    // sequences sharing a key are checked against each other group by group
+    std::vector<std::pair<size_t, size_t>> groups;
+    for (size_t i = 0, j = 0; i < seq_count; i = j) {
+        for (j = i + 1; j < seq_count
+                 && std::get<0>(keys[j]) == std::get<0>(keys[i])
+                 && std::get<1>(keys[j]) == std::get<1>(keys[i]); ++j) { }
+        // empty sequences have no closure to save
+        if (j - i > 1 && std::get<0>(keys[i])) {
+            groups.push_back(std::make_pair(i, j));
+        }
+    }
+    // within a group, the first (lowest ranked) sequence matching a member represents it;
+    // a member matching none of the representatives so far, on a hash collision, becomes one itself
+    std::vector<uint64_t> dup(seq_count, 0);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t g = 0; g < groups.size(); ++g) {
+        std::vector<size_t> reps;
+        for (size_t i = groups[g].first; i < groups[g].second; ++i) {
+            size_t n = std::get<2>(keys[i]);
+            for (auto& rep : reps) {
+                if (same_seq(n, rep, false)) {
+                    dup[n-1] = make_pos_t(rep, false);
+                } else if (same_seq(n, rep, true)) {
+                    dup[n-1] = make_pos_t(rep, true);
+                }
+                if (dup[n-1]) break;
+            }
+            if (!dup[n-1]) reps.push_back(n);
+        }
+    }
+    seq_dup.assign(std::move(dup));
+}
+
+void seqindex_t::collapse_duplicates(bool collapse) {
+    collapse_dups = collapse;
+    // finding the duplicates hashes every sequence, so we only do it when asked to collapse them
+    if (collapse_dups && seq_dup.size() != seq_count) {
+        build_seq_dups();
+    }
+}
+
+size_t seqindex_t::n_duplicates(void) const {
+    if (!collapse_dups) return 0;
+    return seq_count - std::count(seq_dup.begin(), seq_dup.end(), 0);
 }
 
 bool seqindex_t::seq_start(size_t pos) const {
-    return seq_begin_cbv[pos] == 1;
+    return std::binary_search(seq_offset.begin(), seq_offset.end(), pos);
 }
 
 }
@@ -4,67 +4,166 @@
 #include <iostream>
 #include <cstdio>
 #include <string>
+#include <memory>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "sdsl/bit_vectors.hpp"
-#include "sdsl/csa_wt.hpp"
-#include "sdsl/suffix_arrays.hpp"
 #include "sdsl/dac_vector.hpp"
-#include "gzstream.h"
+#include "BooPHF.h"
+#include "pgzstream.hpp"
+#include "packedseq.hpp"
 #include "pos.hpp"
 #include "dna.hpp"
 #include "threads.hpp"
 
 namespace seqwish {
 
+// identifies an input file well enough to decide if an index built from it is still current
+struct input_fingerprint_t {
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    uint64_t sample_hash = 0; // hash of evenly spaced blocks of the file
+    uint64_t in_place = 0; // whether the index reads the file in place
+    uint64_t fai_hash = 0; // hash of the size and time of the .fai read along with a file in place, 0 without one
+    bool operator==(const input_fingerprint_t& o) const {
+        return size == o.size && mtime == o.mtime && sample_hash == o.sample_hash && in_place == o.in_place
+            && fai_hash == o.fai_hash;
+    }
+};
+
+// a read-only array that owns its elements after building the index, or points into the mapped index after loading it
+template<typename T>
+class index_array_t {
+
+private:
+
+    std::vector<T> owned;
+    const T* ptr = nullptr;
+    size_t n = 0;
+
+public:
+
+    void assign(std::vector<T>&& v) {
+        owned = std::move(v);
+        ptr = owned.data();
+        n = owned.size();
+    }
+    void map(const char* p, size_t bytes) {
+        owned.clear();
+        owned.shrink_to_fit();
+        ptr = (const T*)p;
+        n = bytes / sizeof(T);
+    }
+    void clear(void) {
+        owned.clear();
+        owned.shrink_to_fit();
+        ptr = nullptr;
+        n = 0;
+    }
+    const T& operator[](size_t i) const { return ptr[i]; }
+    const T* data(void) const { return ptr; }
+    const T* begin(void) const { return ptr; }
+    const T* end(void) const { return ptr + n; }
+    size_t size(void) const { return n; }
+    size_t bytes(void) const { return n * sizeof(T); }
+
+};
+
 class seqindex_t {
 
 private:
 
     std::string basefilename;
     std::string seqfilename;
-    std::string seqnamefile;
     std::string seqidxfile;
+    // when serving sequence directly from an uncompressed, faidx-compatible FASTA
+    std::string fastafilename;
+    bool faidx_mode = false;
+    index_array_t<uint64_t> fai_offset;
+    index_array_t<uint64_t> fai_line_bases;
+    index_array_t<uint64_t> fai_line_width;
+    size_t fasta_offset(size_t pos) const;
+    void build_dictionaries(const std::string& names,
+                            std::vector<uint64_t>&& name_offsets,
+                            std::vector<uint64_t>&& seq_offsets);
     size_t seq_count = 0;
-    // a file containing the concatenated sequences
+    input_fingerprint_t input_fingerprint;
+    // a file containing the concatenated sequences, 2-bit packed unless we read a FASTA in place
     //std::vector<std::ifstream> seqfiles;
-    char* seq_buf;
+    char* seq_buf = nullptr;
+    packed_seq_t packed_seq;
     int seq_fd = 0;
     size_t seq_size = 0;
-    void open_seq(const std::string& name);
+    // false if the file can't be mapped, or isn't a complete packed sequence
+    bool open_seq(const std::string& name);
     void close_seq(void);
+    // whether a .fai record's lines lie inside the mapped file and end where it says they do
+    bool fai_record_fits(uint64_t length, uint64_t offset, uint64_t line_bases, uint64_t line_width) const;
+    // the index file, mapped read-only and shared between processes once loaded
+    char* idx_buf = nullptr;
+    size_t idx_size = 0;
+    void close_idx(void);
+    // map the index and its sequence, false (with nothing left open) if they're missing, truncated or inconsistent
+    bool map_index(const std::string& filename);
     //std::ifstream& get_seqfile(void);
-    // sequence offsets (for offset and length)
-    sdsl::sd_vector<> seq_begin_cbv;
-    sdsl::sd_vector<>::rank_1_type seq_begin_cbv_rank;
-    sdsl::sd_vector<>::select_1_type seq_begin_cbv_select;
-    // seq name compressed suffix array
-    sdsl::csa_wt<> seq_name_csa;
-    // seq name index
-    sdsl::sd_vector<> seq_name_cbv;
-    sdsl::sd_vector<>::rank_1_type seq_name_cbv_rank;
-    sdsl::sd_vector<>::select_1_type seq_name_cbv_select;
-    uint32_t OUTPUT_VERSION = 1; // update as we change our format
+    // sequence offsets (for offset and length), with a terminating total length
+    index_array_t<uint64_t> seq_offset;
+    // a bitvector of sequence starts with a count of set bits before each 512 bit block,
+    // giving constant time rank, kept only when sequences are short and none are empty
+    index_array_t<uint64_t> seq_begin_words;
+    index_array_t<uint64_t> seq_begin_blocks;
+    static const uint64_t dense_rank_max_mean_length = 1024;
+    void build_seq_begin_rank(void);
+    // seq names, each written as ">name "
+    index_array_t<char> seq_names;
+    // where each name begins in seq_names, with a terminating total length
+    index_array_t<uint64_t> seq_name_offset;
+    // seq name dictionary, a minimal perfect hash of the name hashes mapping to sequence ranks
+    typedef boomphf::mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>> boophf_t;
+    std::unique_ptr<boophf_t> seq_name_mphf;
+    index_array_t<uint64_t> seq_name_rank;
+    uint64_t seq_name_seed = 0;
+    static uint64_t hash_name(const char* name, size_t len, uint64_t seed);
+    void build_name_mphf(void);
+    void name_extent(size_t n, size_t& begin, size_t& length) const;
+    // for each sequence, the earlier sequence it exactly repeats, as make_pos_t(rank, is_rev), or 0 if it's the first copy
+    index_array_t<uint64_t> seq_dup;
+    bool collapse_dups = false;
+    void build_seq_dups(void);
+    bool same_seq(size_t a, size_t b, bool b_rev) const;
+    // 0 if the name isn't in the index
+    size_t find_seq_named(const std::string& name) const;
+    uint32_t OUTPUT_VERSION = 6; // update as we change our format
 
 public:
 
     seqindex_t(void) { }
-    ~seqindex_t(void) { close_seq(); }
+    ~seqindex_t(void) { close_seq(); close_idx(); }
     void set_base_filename(const std::string& filename);
     void build_index(const std::string& filename, const std::string& idxbasename);
+    // index an uncompressed FASTA in place using its .fai (or an equivalent scan), writing no .sqq
+    void build_index_from_faidx(const std::string& filename, const std::string& idxbasename);
     size_t save(sdsl::structure_tree_node* s = NULL, std::string name = "");
+    // map the index written by save, using its structures in place
     void load(const std::string& filename);
+    // load the index at idxbasename if it was built from this input with this format version
+    bool load_if_current(const std::string& filename, const std::string& idxbasename, bool in_place);
+    static input_fingerprint_t fingerprint(const std::string& filename, bool in_place);
     void remove_index_files(void);
     void to_fasta(std::ostream& out, size_t linewidth = 60) const;
     std::string nth_name(size_t n) const;
     size_t rank_of_seq_named(const std::string& name) const;
+    bool has_seq_named(const std::string& name) const;
     size_t nth_seq_length(size_t n) const;
     size_t nth_seq_offset(size_t n) const;
     std::string seq(const std::string& name) const;
     std::string subseq(const std::string& name, size_t pos, size_t count) const;
     std::string subseq(size_t n, size_t pos, size_t count) const;
     std::string subseq(size_t pos, size_t count) const;
+    // the reverse complement of subseq(pos, count)
+    std::string rev_comp_subseq(size_t pos, size_t count) const;
     size_t pos_in_all_seqs(const std::string& name, size_t pos, bool is_rev) const;
     size_t pos_in_all_seqs(size_t n, size_t pos, bool is_rev) const;
     size_t seq_length(void) const;
@@ -73,6 +172,42 @@ public:
     size_t n_seqs(void) const;
     size_t seq_id_at(size_t pos) const;
     bool seq_start(size_t pos) const;
+    // only close the first copy of each exact duplicate (in either orientation), letting the others follow its path
+    void collapse_duplicates(bool collapse);
+    size_t n_duplicates(void) const;
+    // the sequence whose path n reuses and whether it's followed in reverse, or 0 if n is closed itself
+    pos_t duplicate_of(size_t n) const { return collapse_dups ? seq_dup[n-1] : 0; }
+
+};
+
+// follows a position through the concatenated sequences, caching the bounds of the sequence it's in
+// moving within the current sequence costs a comparison, leaving it costs a rank
+// each thread should use its own cursor
+class seq_cursor_t {
+
+private:
+
+    const seqindex_t& seqidx;
+    size_t id = 0;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    void reseek(uint64_t pos) {
+        id = seqidx.seq_id_at(pos);
+        begin = seqidx.nth_seq_offset(id);
+        end = seqidx.nth_seq_offset(id+1);
+    }
+
+public:
+
+    seq_cursor_t(const seqindex_t& s) : seqidx(s) { }
+    // move to the sequence containing pos
+    void seek(uint64_t pos) {
+        if (pos < begin || pos >= end) reseek(pos);
+    }
+    size_t seq_id(void) const { return id; }
+    uint64_t seq_begin(void) const { return begin; }
+    uint64_t seq_end(void) const { return end; }
+    uint64_t seq_length(void) const { return end - begin; }
 
 };
 
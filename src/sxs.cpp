@@ -7,19 +7,44 @@ sxs_t::sxs_t(std::istream& in) {
     load(in);
 }
 
+sxs_t::sxs_t(const std::vector<std::string>& lines) {
+    parse(lines);
+}
+
 void sxs_t::load(std::istream& in) {
+    std::vector<std::string> lines;
+    if (read_lines(in, lines)) {
+        parse(lines);
+    }
+}
+
+bool sxs_t::read_lines(std::istream& in, std::vector<std::string>& lines) {
+    lines.clear();
     char c = in.get();
-    if (in.eof()) return;
+    if (!in) return false;
     // assert we have to start at the alignment
     assert(c == 'A');
     in.unget();
     std::string line;
     std::getline(in, line);
     //std::cerr << "first line " << line << std::endl;
-    bool more = !line.empty();
-    while (more) {
+    if (line.empty()) return false;
+    lines.push_back(line);
+    // check if we're to a new alignment
+    while (in.get(c)) {
+        in.unget();
+        if (c == 'A') break;
+        std::getline(in, line);
+        lines.push_back(line);
+    }
+    return true;
+}
+
+void sxs_t::parse(const std::vector<std::string>& lines) {
+    for (auto& line : lines) {
         std::vector<std::string> fields;
         tokenize(line, fields, " \t");
+        if (fields.empty() || fields[0].empty()) continue;
         char c = fields[0][0];
         switch (c) {
         case 'A':
@@ -47,16 +72,6 @@ void sxs_t::load(std::istream& in) {
         default:
             break;
         }
-        // check if we're to a new alignment
-        if (!in.get(c)) {
-            return;
-        }
-        in.unget();
-        if (c == 'A') {
-            more = false;
-        } else {
-            std::getline(in, line);
-        }
     }
 }
 
@@ -79,4 +94,13 @@ void dump_sxs_alignments(const std::string& filename) {
     }
 }
 
+bool is_sxs_file(const std::string& filename) {
+    ipgzstream in(filename.c_str());
+    std::string line;
+    while (std::getline(in, line) && line.empty()) { }
+    std::vector<std::string> fields;
+    tokenize(line, fields, " \t", true);
+    return !fields.empty() && fields[0] == "A" && fields.size() < 12;
+}
+
 }
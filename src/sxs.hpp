@@ -7,33 +7,42 @@
 #include <vector>
 #include <cassert>
 #include "cigar.hpp"
+#include "pgzstream.hpp"
 
 namespace seqwish {
 
 class sxs_t {
 public:
     std::string query_sequence_name;
-    uint64_t query_sequence_length;
-    uint64_t query_start;
-    uint64_t query_end;
-    bool query_target_same_strand;
+    uint64_t query_sequence_length = 0;
+    uint64_t query_start = 0;
+    uint64_t query_end = 0;
+    bool query_target_same_strand = true;
     std::string target_sequence_name;
-    uint64_t target_sequence_length;
-    uint64_t target_start;
-    uint64_t target_end;
-    uint64_t num_matches;
-    uint16_t mapping_quality;
+    uint64_t target_sequence_length = 0;
+    uint64_t target_start = 0;
+    uint64_t target_end = 0;
+    uint64_t num_matches = 0;
+    uint16_t mapping_quality = 0;
     cigar_t cigar;
     bool good(void) { return query_sequence_name.size() > 0; }
     bool b_rev(void) { return query_start > query_end; }
     sxs_t(void) { }
     sxs_t(std::istream& in);
+    sxs_t(const std::vector<std::string>& lines);
     void load(std::istream& in);
+    // fill in the fields from the lines of one record
+    void parse(const std::vector<std::string>& lines);
+    // read the lines of the next record, up to the next A line, so they can be parsed away from the stream
+    static bool read_lines(std::istream& in, std::vector<std::string>& lines);
     friend std::ostream& operator<<(std::ostream& out, const sxs_t& aln);
 };
 
 void dump_sxs_alignments(const std::string& filename);
 
+// SXS files begin with an A record, which has too few fields to be a PAF line
+bool is_sxs_file(const std::string& filename);
+
 }
 
 #endif
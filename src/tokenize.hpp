@@ -1,6 +1,10 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
 
 // grazie a https://stackoverflow.com/a/1493195/238609
 
@@ -26,3 +30,12 @@ void tokenize(const std::string& str, ContainerT& tokens,
         lastPos = pos + 1;
     }
 }
+
+// a whole field as an unsigned decimal number, or false if it is anything else
+inline bool parse_uint(const std::string& field, uint64_t& value) {
+    if (field.empty() || !std::isdigit((unsigned char)field[0])) return false;
+    char* end;
+    errno = 0;
+    value = std::strtoull(field.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+}
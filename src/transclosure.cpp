@@ -30,10 +30,18 @@ void extend_range(const uint64_t& s_pos,
     }
 }
 
+void mark_node_boundary(const uint64_t& s_pos,
+                        std::vector<uint64_t>& node_bounds) {
+    uint64_t w = s_pos >> 6;
+    if (w >= node_bounds.size()) node_bounds.resize(w + 1, 0);
+    node_bounds[w] |= (uint64_t)1 << (s_pos & 63);
+}
+
 void flush_ranges(const uint64_t& s_pos,
                   std::map<pos_t, std::pair<uint64_t, uint64_t>>& range_buffer,
-                  mmmulti::iitree<uint64_t, pos_t>& node_iitree,
-                  mmmulti::iitree<uint64_t, pos_t>& path_iitree) {
+                  iitree_writer_t<uint64_t, pos_t>& node_writer,
+                  iitree_writer_t<uint64_t, pos_t>& path_writer,
+                  std::vector<uint64_t>& node_bounds) {
     // for each range, we're going to see if we've stepped more than one past the end
     // if we have, we'll write them out
     std::map<pos_t, std::pair<uint64_t, uint64_t>>::iterator it = range_buffer.begin();
@@ -62,8 +70,11 @@ void flush_ranges(const uint64_t& s_pos,
                 match_start_in_q = match_end_in_q;
                 match_end_in_q = offset(match_end_pos_in_q);
             }
-            node_iitree.add(match_start_in_s, match_end_in_s, match_pos_in_q);
-            path_iitree.add(match_start_in_q, match_end_in_q, match_pos_in_s);
+            node_writer.add(match_start_in_s, match_end_in_s, match_pos_in_q);
+            path_writer.add(match_start_in_q, match_end_in_q, match_pos_in_s);
+            // a node can't continue past either end of a range in S, so this is where compaction would break it
+            mark_node_boundary(match_start_in_s, node_bounds);
+            mark_node_boundary(match_end_in_s, node_bounds);
             it = range_buffer.erase(it);
         } else {
             ++it;
@@ -188,7 +199,8 @@ size_t compute_transitive_closures(
     mmmulti::iitree<uint64_t, pos_t>& node_iitree, // maps graph seq ranges to input seq ranges
     mmmulti::iitree<uint64_t, pos_t>& path_iitree, // maps input seq ranges to graph seq ranges
     uint64_t repeat_max,
-    uint64_t transclose_batch_size) { // size of a batch to collect for lock-free transitive closure
+    uint64_t transclose_batch_size,
+    sdsl::bit_vector& seq_id_bv) { // size of a batch to collect for lock-free transitive closure
     // get our thread count as set for openmp (nb: we'll only partly use openmp here)
     uint nthreads = get_thread_count();
     // open seq_v_file
@@ -198,13 +210,31 @@ size_t compute_transitive_closures(
     //sdsl::bit_vector q_seen_bv(seqidx.seq_length());
     atomicbitvector::atomic_bv_t q_seen_bv(seqidx.seq_length());
     uint64_t input_seq_length = seqidx.seq_length();
+    // collapsed duplicates are never closed, so we treat them as already seen
+    if (seqidx.n_duplicates()) {
+#pragma omp parallel for schedule(dynamic)
+        for (size_t n = 1; n <= seqidx.n_seqs(); ++n) {
+            if (!seqidx.duplicate_of(n)) continue;
+            uint64_t end = seqidx.nth_seq_offset(n+1);
+            for (uint64_t j = seqidx.nth_seq_offset(n); j < end; ++j) {
+                q_seen_bv.set(j);
+            }
+        }
+    }
     // a buffer of ranges to write into our iitree, arranged by range ending position in Q
     // we flush those intervals that don't get extended into the next position in S
     // this maps from a position in Q (our input seqs concatenated, offset and orientation)
     // to a range (start and length) in S (our graph sequence vector)
     // we are mapping from the /last/ position in the matched range, not the first
     std::map<pos_t, std::pair<uint64_t, uint64_t>> range_buffer;
+    // the graph emission is single threaded, but we batch its appends into the node and path trees
+    iitree_writer_t<uint64_t, pos_t> node_writer(node_iitree, 1);
+    iitree_writer_t<uint64_t, pos_t> path_writer(path_iitree, 1);
+    // node boundaries in S, as a bitvector that grows with S until we know its length
+    std::vector<uint64_t> node_bounds;
     uint64_t last_seq_id = seqidx.seq_id_at(0);
+    // the emitted positions mostly walk up through Q, so a cursor saves a rank per base
+    seq_cursor_t seq_cursor(seqidx);
     // collect based on a seed chunk of a given length
     for (uint64_t i = 0; i < input_seq_length; ) {
         // scan our q_seen_bv to find our next start
@@ -457,13 +487,14 @@ size_t compute_transitive_closures(
                 // check to see if we've switched sequences
                 // this check assumes that we're walking up through the Q vector
                 // we take the minimum position in Q in the dset and ask if it implies a sequence switch
-                uint64_t curr_seq_id = seqidx.seq_id_at(curr_offset);
+                seq_cursor.seek(curr_offset);
+                uint64_t curr_seq_id = seq_cursor.seq_id();
                 // if we've changed basis sequences, flush
                 if (curr_seq_id != last_seq_id) {
-                    flush_ranges(seq_v_length, range_buffer, node_iitree, path_iitree); // hack to force flush at sequence change
+                    flush_ranges(seq_v_length, range_buffer, node_writer, path_writer, node_bounds); // hack to force flush at sequence change
                     last_seq_id = curr_seq_id;
                 } else {
-                    flush_ranges(seq_v_length-1, range_buffer, node_iitree, path_iitree);
+                    flush_ranges(seq_v_length-1, range_buffer, node_writer, path_writer, node_bounds);
                 }
                 last_dset_id = curr_dset_id;
             }
@@ -513,11 +544,17 @@ size_t compute_transitive_closures(
     // close the graph sequence vector
     size_t seq_bytes = seq_v_out.tellp();
     seq_v_out.close();
-    flush_ranges(seq_bytes+1, range_buffer, node_iitree, path_iitree);
+    flush_ranges(seq_bytes+1, range_buffer, node_writer, path_writer, node_bounds);
     assert(range_buffer.empty());
+    // hand over the node boundaries, including the start and end of S
+    seq_id_bv = sdsl::bit_vector(seq_bytes+1, 0);
+    std::memcpy(seq_id_bv.data(), node_bounds.data(),
+                std::min(node_bounds.size(), (size_t)(seq_bytes >> 6) + 1) * sizeof(uint64_t));
+    seq_id_bv[0] = 1;
+    seq_id_bv[seq_bytes] = 1;
     // build node_mm and path_mm indexes
-    node_iitree.index();
-    path_iitree.index();
+    node_writer.index();
+    path_writer.index();
     return seq_bytes;
 }
 
@@ -6,10 +6,14 @@
 #include <unordered_set>
 #include <set>
 #include <thread>
+#include <vector>
+#include <cstring>
+#include <algorithm>
 #include "sdsl/bit_vectors.hpp"
 #include "atomic_bitvector.hpp"
 #include "seqindex.hpp"
 #include "mmiitree.hpp"
+#include "iitree_writer.hpp"
 #include "pos.hpp"
 #include "match.hpp"
 #include "ips4o.hpp"
@@ -25,10 +29,15 @@ void extend_range(const uint64_t& s_pos,
                   const pos_t& q_pos,
                   std::map<pos_t, std::pair<uint64_t, uint64_t>>& range_buffer);
 
+// set the bit for s_pos in a growing bitvector of node boundaries
+void mark_node_boundary(const uint64_t& s_pos,
+                        std::vector<uint64_t>& node_bounds);
+
 void flush_ranges(const uint64_t& s_pos,
                   std::map<pos_t, std::pair<uint64_t, uint64_t>>& range_buffer,
-                  mmmulti::iitree<uint64_t, pos_t>& node_iitree,
-                  mmmulti::iitree<uint64_t, pos_t>& path_iitree);
+                  iitree_writer_t<uint64_t, pos_t>& node_writer,
+                  iitree_writer_t<uint64_t, pos_t>& path_writer,
+                  std::vector<uint64_t>& node_bounds);
 
 void for_each_fresh_range(const match_t& range,
                           atomicbitvector::atomic_bv_t& seen_bv,
@@ -61,6 +70,7 @@ size_t compute_transitive_closures(
     mmmulti::iitree<uint64_t, pos_t>& node_iitree, // maps graph to input
     mmmulti::iitree<uint64_t, pos_t>& path_iitree, // maps input to graph
     uint64_t repeat_max,
-    uint64_t transclose_batch_size);
+    uint64_t transclose_batch_size,
+    sdsl::bit_vector& seq_id_bv); // node boundaries in the graph sequence, as compact_nodes would mark them
 
 }
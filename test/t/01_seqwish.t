@@ -5,7 +5,7 @@ BASH_TAP_ROOT=bash-tap
 
 PATH=../bin:$PATH # for seqwish
 
-plan tests 29
+plan tests 54
 
 is $(seqwish -h 2>&1 | grep "seqwish: a variation graph inducer" | wc -l) 1 "seqwish prints its help"
 
@@ -38,4 +38,57 @@ is $( seqwish -s HLA/TAP1-6890.fa.gz -p HLA/TAP1-6890.paf.gz -b HLA/TAP1-6890.fa
 is $( seqwish -s HLA/TAP2-6891.fa.gz -p HLA/TAP2-6891.paf.gz -b HLA/TAP2-6891.fa.gz.work -g HLA/TAP2-6891.fa.gz.gfa && md5sum HLA/TAP2-6891.fa.gz.gfa | cut -f 1 -d\ ) $( cat HLA/TAP2-6891.fa.gz.gfa.md5 ) "seqwish correctly builds the graph for TAP2-6891"
 is $( seqwish -s HLA/V-352962.fa.gz -p HLA/V-352962.paf.gz -b HLA/V-352962.fa.gz.work -g HLA/V-352962.fa.gz.gfa && md5sum HLA/V-352962.fa.gz.gfa | cut -f 1 -d\ ) $( cat HLA/V-352962.fa.gz.gfa.md5 ) "seqwish correctly builds the graph for V-352962"
 
-rm -f HLA/*gfa
+zcat HLA/A-3105.paf.gz | cut -f 1,6 >HLA/A-3105.sml
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -m HLA/A-3105.sml -b HLA/A-3105.fa.gz.work -g HLA/A-3105.fa.gz.gfa && md5sum HLA/A-3105.fa.gz.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "a match list covering every aligned pair does not change the graph"
+is $( seqwish -s HLA/B-3106.fa.gz -p HLA/B-3106.paf.gz -u -b HLA/B-3106.fa.gz.work -g HLA/B-3106.fa.gz.gfa 2>/dev/null && md5sum HLA/B-3106.fa.gz.gfa | cut -f 1 -d\  ) $( cat HLA/B-3106.fa.gz.gfa.md5 ) "collapsing reciprocal exact matches does not change the graph"
+zcat HLA/C-3107.fa.gz >HLA/C-3107.fa
+is $( seqwish -s HLA/C-3107.fa -F -p HLA/C-3107.paf.gz -b HLA/C-3107.fa.work -g HLA/C-3107.fa.gfa && md5sum HLA/C-3107.fa.gfa | cut -f 1 -d\  ) $( cat HLA/C-3107.fa.gz.gfa.md5 ) "reading the FASTA in place does not change the graph"
+# the same, taking the record offsets from a .fai as samtools faidx would write it rather than scanning for them
+LC_ALL=C awk 'BEGIN { OFS="\t" } /^>/ { if (name != "") print name, len, off, lb, lb + 1; name = substr($1, 2); len = 0; lb = 0; off = pos + length($0) + 1 } !/^>/ { if (!lb) lb = length($0); len += length($0) } { pos += length($0) + 1 } END { print name, len, off, lb, lb + 1 }' HLA/C-3107.fa >HLA/C-3107.fa.fai
+is $( seqwish -s HLA/C-3107.fa -F -p HLA/C-3107.paf.gz -b HLA/C-3107.fai.work -g HLA/C-3107.fai.gfa && md5sum HLA/C-3107.fai.gfa | cut -f 1 -d\  ) $( cat HLA/C-3107.fa.gz.gfa.md5 ) "reading the FASTA in place through its .fai does not change the graph"
+zcat HLA/TAP2-6891.bgzf.fa.gz | LC_ALL=C awk 'BEGIN { OFS="\t" } /^>/ { if (name != "") print name, len, off, lb, lb + 1; name = substr($1, 2); len = 0; lb = 0; off = pos + length($0) + 1 } !/^>/ { if (!lb) lb = length($0); len += length($0) } { pos += length($0) + 1 } END { print name, len, off, lb, lb + 1 }' >HLA/TAP2-6891.bgzf.fa.gz.fai
+is $( seqwish -s HLA/TAP2-6891.bgzf.fa.gz -F -p HLA/TAP2-6891.paf.gz -b HLA/TAP2-6891.fai.work -g HLA/TAP2-6891.fai.gfa 2>/dev/null; echo $? ) 1 "a compressed FASTA can't be read in place, even with a .fai"
+is $( seqwish -s HLA/DRB1-3123.fa.gz -p HLA/DRB1-3123.paf.gz -L -b HLA/DRB1-3123.fa.gz.work -g HLA/DRB1-3123.fa.gz.gfa && md5sum HLA/DRB1-3123.fa.gz.gfa | cut -f 1 -d\  ) $( cat HLA/DRB1-3123.fa.gz.gfa.md5 ) "deriving links from the paths does not change the graph"
+# record filters that drop every alignment leave each sequence as an unlinked node of its own
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -l 1000000000 -b HLA/A-3105.l.work -g HLA/A-3105.l.gfa && grep -c '^L' HLA/A-3105.l.gfa ) 0 "a minimum block length above every alignment drops them all"
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -I 1.1 -b HLA/A-3105.I.work -g HLA/A-3105.I.gfa && md5sum HLA/A-3105.I.gfa | cut -f 1 -d\  ) $( md5sum HLA/A-3105.l.gfa | cut -f 1 -d\  ) "a minimum identity above 1 drops every alignment"
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -Q 61 -b HLA/A-3105.Q.work -g HLA/A-3105.Q.gfa && md5sum HLA/A-3105.Q.gfa | cut -f 1 -d\  ) $( md5sum HLA/A-3105.l.gfa | cut -f 1 -d\  ) "a minimum mapping quality above every alignment's drops them all"
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -Q 256 -b HLA/A-3105.Q.work -g HLA/A-3105.Q.gfa 2>/dev/null; echo $? ) 1 "a minimum mapping quality above 255 is rejected"
+# the record with the most matches for each query, earliest first on ties
+zcat HLA/A-3105.paf.gz | awk 'BEGIN { OFS="\t" } { print NR, $0 }' | LC_ALL=C sort -t "$(printf '\t')" -k 2,2 -k 11,11nr -k 1,1n | awk -F '\t' '!seen[$2]++' | LC_ALL=C sort -t "$(printf '\t')" -k 1,1n | cut -f 2- >HLA/A-3105.n1.paf HLA/A-3105.1.paf HLA/A-3105.2.paf
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -n 1 -b HLA/A-3105.n.work -g HLA/A-3105.n.gfa && md5sum HLA/A-3105.n.gfa | cut -f 1 -d\  ) $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.n1.paf -b HLA/A-3105.n1.work -g HLA/A-3105.n1.gfa && md5sum HLA/A-3105.n1.gfa | cut -f 1 -d\  ) "keeping one alignment per query uses only the best record of each"
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -N 1000000 -b HLA/A-3105.N.work -g HLA/A-3105.N.gfa && md5sum HLA/A-3105.N.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "keeping more matches per base than overlap any of them does not change the graph"
+isnt $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -N 1 -b HLA/A-3105.N.work -g HLA/A-3105.N.gfa && md5sum HLA/A-3105.N.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "keeping only the longest match at each base changes the graph"
+zcat HLA/A-3105.paf.gz | awk 'NR % 2' >HLA/A-3105.1.paf
+zcat HLA/A-3105.paf.gz | awk 'NR % 2 == 0' >HLA/A-3105.2.paf
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.1.paf,HLA/A-3105.2.paf -t 4 -b HLA/A-3105.split.work -g HLA/A-3105.split.gfa && md5sum HLA/A-3105.split.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "alignments split across two files build the same graph"
+# BGZF copies of the TAP2 inputs, in small enough blocks that reading them takes several batches
+is $( seqwish -s HLA/TAP2-6891.bgzf.fa.gz -p HLA/TAP2-6891.bgzf.paf.gz -t 2 -b HLA/TAP2-6891.bgzf.work -g HLA/TAP2-6891.bgzf.gfa && md5sum HLA/TAP2-6891.bgzf.gfa | cut -f 1 -d\  ) $( cat HLA/TAP2-6891.fa.gz.gfa.md5 ) "BGZF inputs build the same graph as gzip ones"
+# -K keeps the sequence index, a second run over the same input reuses it, and one over a changed input rebuilds it
+cp HLA/A-3105.fa.gz HLA/A-3105.keep.fa.gz
+is $( seqwish -s HLA/A-3105.keep.fa.gz HLA/A-3105.pansn.fa HLA/A-3105.pansn.paf -p HLA/A-3105.paf.gz -K -b HLA/A-3105.keep -g HLA/A-3105.keep.gfa && md5sum HLA/A-3105.keep.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "-K does not change the graph"
+is $( seqwish -s HLA/A-3105.keep.fa.gz HLA/A-3105.pansn.fa HLA/A-3105.pansn.paf -p HLA/A-3105.paf.gz -K -b HLA/A-3105.keep -g HLA/A-3105.keep.gfa 2>&1 >/dev/null | grep -c "reusing the sequence index" ) 1 "a second -K run reuses the sequence index"
+is $( md5sum HLA/A-3105.keep.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "the reused sequence index builds the same graph"
+touch -d 2000-01-01 HLA/A-3105.keep.fa.gz
+is $( seqwish -s HLA/A-3105.keep.fa.gz HLA/A-3105.pansn.fa HLA/A-3105.pansn.paf -p HLA/A-3105.paf.gz -K -b HLA/A-3105.keep -g HLA/A-3105.keep.gfa 2>&1 >/dev/null | grep -c "reusing the sequence index" ) 0 "the sequence index is rebuilt when the input changes"
+
+# the same alignments as SXS records, with the query coordinates swapped on the reverse strand
+zcat HLA/A-3105.paf.gz | awk 'BEGIN { OFS="\t" } { cg=""; for (i=13; i<=NF; ++i) if ($i ~ /^cg:Z:/) cg=substr($i, 6); print "A", $6, $1; if ($5 == "+") print "I", $8, $9, $3, $4; else print "I", $8, $9, $4, $3; print "M", $10; print "C", cg; print "Q", $12 }' >HLA/A-3105.sxs
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.sxs -b HLA/A-3105.sxs.work -g HLA/A-3105.sxs.gfa && md5sum HLA/A-3105.sxs.gfa | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "SXS alignments build the same graph as the equivalent PAF"
+# the other path line styles, turned back into the default P lines
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -P P1 -b HLA/A-3105.P1.work -g HLA/A-3105.P1.gfa && md5sum HLA/A-3105.P1.gfa | cut -f 1 -d\  ) $( awk 'BEGIN { OFS="\t" } $1 == "P" { $4 = "*" } { print }' HLA/A-3105.fa.gz.gfa | md5sum | cut -f 1 -d\  ) "P1 lines differ from P lines only in their overlaps"
+is $( seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -P W -b HLA/A-3105.W.work -g HLA/A-3105.W.gfa && awk 'BEGIN { OFS="\t" } $1 == "H" { print "H", "VN:Z:1.0"; next } $1 == "W" { w = $7; gsub(/>/, ",>", w); gsub(/</, ",<", w); n = split(substr(w, 2), s, ","); p = ""; for (i = 1; i <= n; ++i) p = p (i > 1 ? "," : "") substr(s[i], 2) (substr(s[i], 1, 1) == ">" ? "+" : "-"); o = "*"; for (i = 3; i <= n; ++i) o = o ",*"; print "P", $2, p, o; next } { print }' HLA/A-3105.W.gfa | md5sum | cut -f 1 -d\  ) $( cat HLA/A-3105.fa.gz.gfa.md5 ) "W lines walk the same steps as P lines"
+# W lines split PanSN names, sample#haplotype#contig, into their columns, and empty sequences get none
+zcat HLA/A-3105.fa.gz | awk '/^>/ { n++; $0 = n < 11 ? ">sample" n "#" (n % 2 + 1) "#" substr($1, 2) : $1 } { print } END { print ">sample11#1#empty" }' >HLA/A-3105.pansn.fa
+zcat HLA/A-3105.paf.gz | awk 'BEGIN { OFS="\t" } NR == FNR { if (/^>/) { n = split(substr($1, 2), f, "#"); name[f[n]] = substr($1, 2) } next } { $1 = name[$1]; $6 = name[$6]; print }' HLA/A-3105.pansn.fa - >HLA/A-3105.pansn.paf
+is $( seqwish -s HLA/A-3105.pansn.fa -p HLA/A-3105.pansn.paf -P W -b HLA/A-3105.pansn.work -g HLA/A-3105.pansn.gfa && awk 'BEGIN { OFS="\t" } $1 == "W" { print $2, $3, $4, $5, $6 }' HLA/A-3105.pansn.gfa | md5sum | cut -f 1 -d\  ) $( awk 'BEGIN { OFS="\t" } function walk() { if (!len) return; n = split(name, f, "#"); print n == 3 ? f[1] : name, n == 3 ? f[2] : 0, f[n], 0, len } /^>/ { walk(); name = substr($1, 2); len = 0; next } { len += length($0) } END { walk() }' HLA/A-3105.pansn.fa | md5sum | cut -f 1 -d\  ) "W lines take their sample, haplotype and contig from PanSN names and skip empty sequences"
+# a copy of the first A-3105 sequence takes over its alignments, which -C has to move back onto the original
+first=$( zcat HLA/A-3105.fa.gz | head -1 | cut -c 2- | cut -f 1 -d\  )
+( zcat HLA/A-3105.fa.gz; zcat HLA/A-3105.fa.gz | awk '/^>/ { if (n++) exit; print ">copy"; next } { print }' ) >HLA/A-3105.copy.fa
+zcat HLA/A-3105.paf.gz | awk -v f="$first" 'BEGIN { OFS="\t" } $1 != $6 { if ($1 == f) $1 = "copy"; if ($6 == f) $6 = "copy" } { print }' >HLA/A-3105.copy.paf
+seqwish -s HLA/A-3105.fa.gz -p HLA/A-3105.paf.gz -C -b HLA/A-3105.C.work -g HLA/A-3105.C.gfa 2>/dev/null
+seqwish -s HLA/A-3105.copy.fa HLA/A-3105.keep.fa.gz HLA/A-3105.pansn.fa HLA/A-3105.pansn.paf HLA/A-3105.keep.sqq HLA/A-3105.keep.sqi -p HLA/A-3105.copy.paf -C -b HLA/A-3105.copy.work -g HLA/A-3105.copy.gfa 2>/dev/null
+is $( awk '$1 != "P" || $2 != "copy"' HLA/A-3105.copy.gfa | md5sum | cut -f 1 -d\  ) $( md5sum <HLA/A-3105.C.gfa | cut -f 1 -d\  ) "collapsing duplicates moves a copy's alignments onto the sequence it copies"
+is "$( awk '$1 == "P" && $2 == "copy" { print $3 }' HLA/A-3105.copy.gfa )" "$( awk -v f="$first" '$1 == "P" && $2 == f { print $3 }' HLA/A-3105.C.gfa )" "a collapsed duplicate follows the path of the sequence it copies"
+
+rm -f HLA/*gfa HLA/*sml HLA/*sxs HLA/C-3107.fa HLA/C-3107.fa.fai HLA/TAP2-6891.bgzf.fa.gz.fai HLA/A-3105.copy.fa HLA/A-3105.keep.fa.gz HLA/A-3105.pansn.fa HLA/A-3105.pansn.paf HLA/A-3105.keep.sqq HLA/A-3105.keep.sqi HLA/A-3105.copy.paf HLA/A-3105.n1.paf HLA/A-3105.1.paf HLA/A-3105.2.paf